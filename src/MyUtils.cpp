@@ -1629,105 +1629,50 @@ BOOL LoadNIIDataSize(LPCTSTR lpszPathName, int& vd_x, int& vd_y, int& vd_z, int&
 
 	return TRUE;
 }
+
+// Reads the dimensions, voxel size, origin and orientation of the NIfTI image
+// pNII, and whether LoadNIIData flips its voxels along x, y and z (si, sj, sk)
+void ParseNIIHeader(nifti_image* pNII, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc, int& si, int& sj, int& sk)
+{
+	vd_x = pNII->nx;
+	vd_y = pNII->ny;
+	vd_z = pNII->nz;
+	if (pNII->nt > 1 || pNII->nu <= 1) {
+		vd_s = pNII->nt;
+	} else if (pNII->nt <= 1 || pNII->nu > 1) {
+		vd_s = pNII->nu;
+	} else {
+		vd_s = 1;
+	}
+	vd_dx = pNII->dx;
+	vd_dy = pNII->dy;
+	vd_dz = pNII->dz;
+	vd_ox = pNII->qoffset_x;
+	vd_oy = pNII->qoffset_y;
+	vd_oz = pNII->qoffset_z;
+	vd_oc = pNII->analyze75_orient;
+	//
+#ifndef USE_ASSUME_LPS
+	int icod, jcod, kcod;
+
+	nifti_mat44_to_orientation(pNII->qto_ijk, &icod, &jcod, &kcod);
+	si = (icod == NIFTI_R2L) ? 0 : 1;
+	sj = (jcod == NIFTI_A2P) ? 0 : 1;
+	sk = (kcod == NIFTI_I2S) ? 0 : 1;
+#else
+	si = sj = sk = 0;
+#endif
+}
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
 
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
-BOOL ChangeNIIHeader(char* target_file, char* header_file)
+// Copies the geometry, scaling, intent and description fields of the header
+// h_pNII to t_pNII
+static void CopyNIIHeader(nifti_image* t_pNII, nifti_image* h_pNII)
 {
-	nifti_image* h_pNII;
-	nifti_image* t_pNII;
-
-	h_pNII = nifti_image_read(header_file, 1);
-	if (h_pNII == NULL) {
-		return FALSE;
-	}
-
-	t_pNII = nifti_image_read(target_file, 1);
-	if (t_pNII == NULL) {
-		return FALSE;
-	}
-
-#if 0
-	int i, j, k, l;
-	int vd_x, vd_y, vd_z, vd_s;
-
-	vd_x = t_pNII->nx;
-	vd_y = t_pNII->ny;
-	vd_z = t_pNII->nz;
-	vd_s = t_pNII->nt;
-
-	if (vd_x != h_pNII->nx || vd_y != h_pNII->ny || vd_z != h_pNII->nz || vd_s != h_pNII->nt) {
-		return FALSE;
-	}
-	if (t_pNII->nbyper != h_pNII->nbyper) {
-		return FALSE;
-	}
-	if (t_pNII->datatype != h_pNII->datatype) {
-		return FALSE;
-	}
-	
-	if (t_pNII->nbyper == 1) {
-		for (k = 0; k < vd_z; k++) {
-			for (j = 0; j < vd_y; j++) {
-				for (i = 0; i < vd_x; i++) {
-					BYTE* p = (BYTE*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-					BYTE* q = (BYTE*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-					for (l = 0; l < vd_s; l++) {
-						*q++ = *p++;
-					}
-				}
-			}
-		}
-	} else if (t_pNII->nbyper == 2) {
-		if (t_pNII->datatype == DT_INT16) {
-			for (k = 0; k < vd_z; k++) {
-				for (j = 0; j < vd_y; j++) {
-					for (i = 0; i < vd_x; i++) {
-						short* p = (short*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-						short* q = (short*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-						for (l = 0; l < vd_s; l++) {
-							*q++ = *p++;
-						}
-					}
-				}
-			}
-		} else {
-		}
-	} else if (t_pNII->nbyper == 4) {
-		if (t_pNII->datatype == DT_FLOAT32) {
-			for (k = 0; k < vd_z; k++) {
-				for (j = 0; j < vd_y; j++) {
-					for (i = 0; i < vd_x; i++) {
-						float* p = (float*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-						float* q = (float*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
-						for (l = 0; l < vd_s; l++) {
-							*q++ = *p++;
-						}
-					}
-				}
-			}
-		} else {
-		}
-	} else {
-	}
-
-	h_pNII->nbyper = t_pNII->nbyper;
-	h_pNII->datatype = t_pNII->datatype;
-
-	free(h_pNII->fname);
-	h_pNII->fname = (char*)malloc(1024 * sizeof(char));
-	strcpy(h_pNII->fname, t_pNII->fname);
-
-	free(h_pNII->iname);
-	h_pNII->iname = (char*)malloc(1024 * sizeof(char));
-	strcpy(h_pNII->iname, t_pNII->iname);
-
-	nifti_image_write(h_pNII);
-#endif
-#if 1
 	t_pNII->dx = h_pNII->dx;
 	t_pNII->dy = h_pNII->dy;
 	t_pNII->dz = h_pNII->dz;
@@ -1845,6 +1790,102 @@ BOOL ChangeNIIHeader(char* target_file, char* header_file)
 	memcpy(t_pNII->aux_file, h_pNII->aux_file, 24*sizeof(char));
 
 	t_pNII->analyze75_orient = h_pNII->analyze75_orient;
+}
+
+BOOL ChangeNIIHeader(char* target_file, char* header_file)
+{
+	nifti_image* h_pNII;
+	nifti_image* t_pNII;
+
+	h_pNII = nifti_image_read(header_file, 1);
+	if (h_pNII == NULL) {
+		return FALSE;
+	}
+
+	t_pNII = nifti_image_read(target_file, 1);
+	if (t_pNII == NULL) {
+		return FALSE;
+	}
+
+#if 0
+	int i, j, k, l;
+	int vd_x, vd_y, vd_z, vd_s;
+
+	vd_x = t_pNII->nx;
+	vd_y = t_pNII->ny;
+	vd_z = t_pNII->nz;
+	vd_s = t_pNII->nt;
+
+	if (vd_x != h_pNII->nx || vd_y != h_pNII->ny || vd_z != h_pNII->nz || vd_s != h_pNII->nt) {
+		return FALSE;
+	}
+	if (t_pNII->nbyper != h_pNII->nbyper) {
+		return FALSE;
+	}
+	if (t_pNII->datatype != h_pNII->datatype) {
+		return FALSE;
+	}
+	
+	if (t_pNII->nbyper == 1) {
+		for (k = 0; k < vd_z; k++) {
+			for (j = 0; j < vd_y; j++) {
+				for (i = 0; i < vd_x; i++) {
+					BYTE* p = (BYTE*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+					BYTE* q = (BYTE*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+					for (l = 0; l < vd_s; l++) {
+						*q++ = *p++;
+					}
+				}
+			}
+		}
+	} else if (t_pNII->nbyper == 2) {
+		if (t_pNII->datatype == DT_INT16) {
+			for (k = 0; k < vd_z; k++) {
+				for (j = 0; j < vd_y; j++) {
+					for (i = 0; i < vd_x; i++) {
+						short* p = (short*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+						short* q = (short*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+						for (l = 0; l < vd_s; l++) {
+							*q++ = *p++;
+						}
+					}
+				}
+			}
+		} else {
+		}
+	} else if (t_pNII->nbyper == 4) {
+		if (t_pNII->datatype == DT_FLOAT32) {
+			for (k = 0; k < vd_z; k++) {
+				for (j = 0; j < vd_y; j++) {
+					for (i = 0; i < vd_x; i++) {
+						float* p = (float*)t_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+						float* q = (float*)h_pNII->data + ((k*vd_y+j)*vd_x+i)*vd_s;
+						for (l = 0; l < vd_s; l++) {
+							*q++ = *p++;
+						}
+					}
+				}
+			}
+		} else {
+		}
+	} else {
+	}
+
+	h_pNII->nbyper = t_pNII->nbyper;
+	h_pNII->datatype = t_pNII->datatype;
+
+	free(h_pNII->fname);
+	h_pNII->fname = (char*)malloc(1024 * sizeof(char));
+	strcpy(h_pNII->fname, t_pNII->fname);
+
+	free(h_pNII->iname);
+	h_pNII->iname = (char*)malloc(1024 * sizeof(char));
+	strcpy(h_pNII->iname, t_pNII->iname);
+
+	nifti_image_write(h_pNII);
+#endif
+#if 1
+	CopyNIIHeader(t_pNII, h_pNII);
 
 	nifti_image_write(t_pNII);
 #endif
@@ -1854,6 +1895,345 @@ BOOL ChangeNIIHeader(char* target_file, char* header_file)
 
 	return TRUE;
 }
+
+template <class T>
+static void ConvertNIISlices(const T* p, int nz, int vd_x, int vd_y, int vd_s, int si, int sj, float* pData)
+{
+	int i, j, k, l;
+
+	for (k = 0; k < nz; k++) {
+		for (j = 0; j < vd_y; j++) {
+			for (i = 0; i < vd_x; i++) {
+				float* q = pData + (((ptrdiff_t)k*vd_y + (1-sj)*j+(sj)*(vd_y-1-j))*vd_x + (1-si)*i+(si)*(vd_x-1-i))*vd_s;
+				for (l = 0; l < vd_s; l++) {
+					q[l] = (float)*p++;
+				}
+			}
+		}
+	}
+}
+
+// Opens the NIfTI file lpszPathName, named as in LoadNIIData, for ReadNIISlices.
+// Fails for the data types which LoadNIIData does not read and for the volumes
+// it would flip along z.
+BOOL OpenNIIStream(LPCTSTR lpszPathName, NIIStream* stream, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc)
+{
+	nifti_image* pNII = NULL;
+	znzFile fp;
+	char fname[1024];
+	char ext[1024];
+	int si, sj, sk;
+
+	if (strlen(lpszPathName) < 6) {
+		strcpy(fname, lpszPathName);
+	} else {
+		strncpy(ext, (char*)&lpszPathName[strlen(lpszPathName)-3], 3);
+		ext[3] = 0;
+		if (strcmp(ext, "img") != 0 && strcmp(ext, "hdr") != 0 && strcmp(ext, "nii") != 0) {
+			strncpy(ext, (char*)&lpszPathName[strlen(lpszPathName)-6], 6);
+			ext[6] = 0;
+			if (strcmp(ext, "nii.gz") != 0) {
+				sprintf(fname, "%s.nii.gz", lpszPathName);
+			} else {
+				strcpy(fname, lpszPathName);
+			}
+		} else {
+			strcpy(fname, lpszPathName);
+		}
+	}
+
+	fp = nifti_image_open(fname, (char*)"rb", &pNII);
+	if (znz_isnull(fp)) {
+		if (pNII != NULL) {
+			nifti_image_free(pNII);
+		}
+		return FALSE;
+	}
+
+	ParseNIIHeader(pNII, vd_x, vd_y, vd_z, vd_s, vd_dx, vd_dy, vd_dz, vd_ox, vd_oy, vd_oz, vd_oc, si, sj, sk);
+	// the slices come in file order
+	if (sk || pNII->iname_offset < 0 || (size_t)vd_x*vd_y*vd_z*vd_s > pNII->nvox ||
+		!(pNII->nbyper == 1 ||
+		  (pNII->nbyper == 2 && (pNII->datatype == DT_INT16 || pNII->datatype == DT_UINT16)) ||
+		  (pNII->nbyper == 4 && (pNII->datatype == DT_FLOAT32 || pNII->datatype == DT_INT32)) ||
+		  (pNII->nbyper == 8 && pNII->datatype == DT_FLOAT64))) {
+		znzclose(fp);
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+	if (znzseek(fp, pNII->iname_offset, SEEK_SET) < 0) {
+		znzclose(fp);
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+
+	stream->pNII = pNII;
+	stream->fp = fp;
+	stream->vd_x = vd_x;
+	stream->vd_y = vd_y;
+	stream->vd_z = vd_z;
+	stream->vd_s = vd_s;
+	stream->si = si;
+	stream->sj = sj;
+	stream->buf = NULL;
+	stream->buf_size = 0;
+
+	return TRUE;
+}
+
+// Reads the next nz slices of the stream into pData, vd_x*vd_y*vd_s floats
+// per slice
+BOOL ReadNIISlices(NIIStream* stream, int nz, float* pData)
+{
+	nifti_image* pNII = stream->pNII;
+	size_t nv = (size_t)nz*stream->vd_x*stream->vd_y*stream->vd_s;
+	size_t size = nv * pNII->nbyper;
+
+	if (size > stream->buf_size) {
+		free(stream->buf);
+		stream->buf = malloc(size);
+		stream->buf_size = (stream->buf != NULL) ? size : 0;
+		if (stream->buf == NULL) {
+			return FALSE;
+		}
+	}
+	if (nifti_read_buffer(stream->fp, stream->buf, size, pNII) != size) {
+		return FALSE;
+	}
+
+	if (pNII->nbyper == 1) {
+		ConvertNIISlices((const BYTE*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	} else if (pNII->datatype == DT_INT16) {
+		ConvertNIISlices((const short*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	} else if (pNII->datatype == DT_UINT16) {
+		ConvertNIISlices((const unsigned short*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	} else if (pNII->datatype == DT_FLOAT32) {
+		ConvertNIISlices((const float*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	} else if (pNII->datatype == DT_INT32) {
+		ConvertNIISlices((const int*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	} else {
+		ConvertNIISlices((const double*)stream->buf, nz, stream->vd_x, stream->vd_y, stream->vd_s, stream->si, stream->sj, pData);
+	}
+
+	return TRUE;
+}
+
+// Name which CreateNIIStream and SaveNIIData give to nifti for lpszPathName
+static void NIIStreamName(LPCTSTR lpszPathName, char* fname)
+{
+	char ext[1024];
+
+	if (strlen(lpszPathName) < 6) {
+		strcpy(fname, lpszPathName);
+	} else {
+		strncpy(ext, (char*)&lpszPathName[strlen(lpszPathName)-6], 6);
+		ext[6] = 0;
+		if (strcmp(ext, "nii.gz") != 0) {
+			sprintf(fname, "%s.nii.gz", lpszPathName);
+		} else {
+			strcpy(fname, lpszPathName);
+		}
+	}
+}
+
+// Returns TRUE if CreateNIIStream(lpszPathName) would overwrite the file read
+// by the stream, possibly under another name
+BOOL IsNIIStreamFile(NIIStream* stream, LPCTSTR lpszPathName)
+{
+	char fname[1024];
+	char* iname;
+	BOOL same;
+
+	// the file which nifti writes, the extension .nii being added to the
+	// short names
+	NIIStreamName(lpszPathName, fname);
+	iname = nifti_makeimgname(fname, NIFTI_FTYPE_NIFTI1_1, 0, nifti_is_gzfile(fname));
+	if (iname == NULL) {
+		return FALSE;
+	}
+#if defined(WIN32) || defined(WIN64)
+	char fa[_MAX_PATH], fb[_MAX_PATH];
+	same = _fullpath(fa, stream->pNII->iname, _MAX_PATH) != NULL && _fullpath(fb, iname, _MAX_PATH) != NULL && _stricmp(fa, fb) == 0;
+#else
+	struct stat sa, sb;
+	same = stat(stream->pNII->iname, &sa) == 0 && stat(iname, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+	free(iname);
+
+	return same;
+}
+
+// Creates the float NIfTI file lpszPathName with the header which SaveNIIData
+// followed by ChangeNIIHeader from header_file would write, and leaves it open
+// for WriteNIISlices
+BOOL CreateNIIStream(LPCTSTR lpszPathName, char* header_file, NIIStream* stream, int vd_x, int vd_y, int vd_z, int vd_s, float vd_dx, float vd_dy, float vd_dz, float vd_ox, float vd_oy, float vd_oz, analyze_75_orient_code vd_oc)
+{
+	nifti_image* pNII;
+	nifti_image* t_pNII;
+	nifti_image* h_pNII;
+	nifti_1_header nhdr;
+	znzFile fp;
+	char fname[1024];
+
+	int dims[] = { 4, vd_x, vd_y, vd_z, vd_s, 1, 1, 1 };
+	pNII = nifti_make_new_nim(dims, DT_FLOAT32, 0);
+	if (pNII == NULL) {
+		return FALSE;
+	}
+	pNII->datatype = DT_FLOAT32;
+
+	NIIStreamName(lpszPathName, fname);
+
+	pNII->dx = vd_dx;
+	pNII->dy = vd_dy;
+	pNII->dz = vd_dz;
+	pNII->qoffset_x = vd_ox;
+	pNII->qoffset_y = vd_oy;
+	pNII->qoffset_z = vd_oz;
+	pNII->analyze75_orient = vd_oc;
+	//
+	// LPS
+	pNII->qform_code = 1;
+	pNII->quatern_d = 1;
+	pNII->qfac = 1;
+
+	// the header as ChangeNIIHeader reads it back
+	nhdr = nifti_convert_nim2nhdr(pNII);
+	nifti_image_free(pNII);
+	t_pNII = nifti_convert_nhdr2nim(nhdr, fname);
+	if (t_pNII == NULL) {
+		return FALSE;
+	}
+	h_pNII = nifti_image_read(header_file, 0);
+	if (h_pNII != NULL) {
+		CopyNIIHeader(t_pNII, h_pNII);
+		nifti_image_free(h_pNII);
+	}
+
+	fp = nifti_image_write_hdr_img2(t_pNII, 2, "wb", NULL, NULL);
+	if (znz_isnull(fp)) {
+		nifti_image_free(t_pNII);
+		return FALSE;
+	}
+
+	stream->pNII = t_pNII;
+	stream->fp = fp;
+	stream->vd_x = vd_x;
+	stream->vd_y = vd_y;
+	stream->vd_z = vd_z;
+	stream->vd_s = vd_s;
+	stream->si = stream->sj = 0;
+	stream->buf = NULL;
+	stream->buf_size = 0;
+
+	return TRUE;
+}
+
+// Writes the next nz slices of the stream from pData
+BOOL WriteNIISlices(NIIStream* stream, int nz, const float* pData)
+{
+	size_t size = (size_t)nz*stream->vd_x*stream->vd_y*stream->vd_s * sizeof(float);
+
+	return nifti_write_buffer(stream->fp, pData, size) == size;
+}
+
+void CloseNIIStream(NIIStream* stream)
+{
+	znzclose(stream->fp);
+	nifti_image_free(stream->pNII);
+	free(stream->buf);
+	stream->pNII = NULL;
+	stream->buf = NULL;
+}
+
+// Maps the voxels of the uncompressed NIfTI file lpszPathName, a .nii name,
+// for ReadNIIMappedRow, so that they are read in place rather than copied by
+// LoadNIIData. Fails, the caller falling back to LoadNIIData, for the other
+// files, the byte swapped ones, the data types which LoadNIIData does not
+// read, and on the systems without mmap.
+BOOL MapNIIData(LPCTSTR lpszPathName, NIIMapping* mapping, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc)
+{
+#if defined(WIN32) || defined(WIN64)
+	return FALSE;
+#else
+	nifti_image* pNII;
+	struct stat st;
+	size_t len = strlen(lpszPathName), size;
+	void* base;
+	int fd;
+	int si, sj, sk;
+
+	if (len < 4 || strcmp(&lpszPathName[len-4], ".nii") != 0) {
+		return FALSE;
+	}
+	pNII = nifti_image_read(lpszPathName, 0);
+	if (pNII == NULL) {
+		return FALSE;
+	}
+
+	ParseNIIHeader(pNII, vd_x, vd_y, vd_z, vd_s, vd_dx, vd_dy, vd_dz, vd_ox, vd_oy, vd_oz, vd_oc, si, sj, sk);
+	size = (size_t)vd_x*vd_y*vd_z*vd_s;
+	if (pNII->nifti_type != NIFTI_FTYPE_NIFTI1_1 || pNII->byteorder != nifti_short_order() ||
+		pNII->iname_offset < 0 || size > pNII->nvox ||
+		!(pNII->nbyper == 1 ||
+		  (pNII->nbyper == 2 && (pNII->datatype == DT_INT16 || pNII->datatype == DT_UINT16)) ||
+		  (pNII->nbyper == 4 && (pNII->datatype == DT_FLOAT32 || pNII->datatype == DT_INT32)) ||
+		  (pNII->nbyper == 8 && pNII->datatype == DT_FLOAT64))) {
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+	size *= pNII->nbyper;
+
+	fd = open(lpszPathName, O_RDONLY);
+	if (fd < 0) {
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < pNII->iname_offset + size) {
+		close(fd);
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		nifti_image_free(pNII);
+		return FALSE;
+	}
+
+	mapping->base = base;
+	mapping->length = st.st_size;
+	mapping->nbyper = pNII->nbyper;
+	mapping->datatype = pNII->datatype;
+	mapping->sx = (ptrdiff_t)vd_s*pNII->nbyper;
+	mapping->sy = mapping->sx*vd_x;
+	mapping->sz = mapping->sy*vd_y;
+	mapping->origin = (const char*)base + pNII->iname_offset +
+		si*(vd_x-1)*mapping->sx + sj*(vd_y-1)*mapping->sy + sk*(vd_z-1)*mapping->sz;
+	if (si) {
+		mapping->sx = -mapping->sx;
+	}
+	if (sj) {
+		mapping->sy = -mapping->sy;
+	}
+	if (sk) {
+		mapping->sz = -mapping->sz;
+	}
+
+	nifti_image_free(pNII);
+
+	return TRUE;
+#endif
+}
+
+void UnmapNIIData(NIIMapping* mapping)
+{
+#if !defined(WIN32) && !defined(WIN64)
+	munmap(mapping->base, mapping->length);
+#endif
+	mapping->base = NULL;
+	mapping->origin = NULL;
+}
 /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////
 
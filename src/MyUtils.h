@@ -138,6 +138,7 @@ template <class T>
 BOOL SaveVoxelData(LPCTSTR lpszPathName, T**** pVoxelData, int vd_x, int vd_y, int vd_z, int vd_s);
 //
 BOOL LoadNIIDataSize(LPCTSTR lpszPathName, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz);
+void ParseNIIHeader(nifti_image* pNII, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc, int& si, int& sj, int& sk);
 template <class T>
 BOOL LoadNIIData(LPCTSTR lpszPathName, T***** pVoxelData, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc);
 template <class T>
@@ -150,6 +151,42 @@ BOOL SaveIMGData(LPCTSTR img_name, LPCTSTR hdr_name, T**** pVoxelData, int vd_x,
 //
 BOOL ChangeNIIHeader(char* target_file, char* header_file);
 //
+// Slice by slice access to the voxels of a NIfTI file, for the volumes which
+// do not fit in memory: the slices are read or written in order, vd_s floats
+// per voxel as in the volumes of LoadNIIData and SaveNIIData
+typedef struct {
+	nifti_image* pNII;
+	znzFile fp;
+	int vd_x, vd_y, vd_z, vd_s;
+	// flips of x and y of LoadNIIData
+	int si, sj;
+	// raw slices being converted
+	void* buf;
+	size_t buf_size;
+} NIIStream;
+BOOL OpenNIIStream(LPCTSTR lpszPathName, NIIStream* stream, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc);
+BOOL ReadNIISlices(NIIStream* stream, int nz, float* pData);
+BOOL IsNIIStreamFile(NIIStream* stream, LPCTSTR lpszPathName);
+BOOL CreateNIIStream(LPCTSTR lpszPathName, char* header_file, NIIStream* stream, int vd_x, int vd_y, int vd_z, int vd_s, float vd_dx, float vd_dy, float vd_dz, float vd_ox, float vd_oy, float vd_oz, analyze_75_orient_code vd_oc);
+BOOL WriteNIISlices(NIIStream* stream, int nz, const float* pData);
+void CloseNIIStream(NIIStream* stream);
+//
+// Voxels of an uncompressed NIfTI file mapped read-only in memory, indexed as
+// the volumes of LoadNIIData: the channel l of the voxel (i, j, k) is at
+// origin + i*sx + j*sy + k*sz + l*nbyper, the strides being negative along
+// the axes which LoadNIIData flips
+typedef struct {
+	void* base;
+	size_t length;
+	const char* origin;
+	ptrdiff_t sx, sy, sz;
+	int nbyper, datatype;
+} NIIMapping;
+BOOL MapNIIData(LPCTSTR lpszPathName, NIIMapping* mapping, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc);
+void UnmapNIIData(NIIMapping* mapping);
+template <class T>
+void ReadNIIMappedRow(const NIIMapping* mapping, int j, int k, int vd_x, int nl, T* pData);
+//
 BOOL ReadXFMData(LPCTSTR xfm_name, float a[4][4]);
 //
 #ifdef USE_METAIO
@@ -359,7 +396,6 @@ BOOL LoadNIIData(LPCTSTR lpszPathName, T***** pVoxelData, int& vd_x, int& vd_y,
 	BOOL bRes = FALSE;
 	char fname[1024];
 	char ext[1024];
-	int icod, jcod, kcod;
 	int si, sj, sk;
 
 	if (strlen(lpszPathName) < 6) {
@@ -367,7 +403,7 @@ BOOL LoadNIIData(LPCTSTR lpszPathName, T***** pVoxelData, int& vd_x, int& vd_y,
 	} else {
 		strncpy(ext, (char*)&lpszPathName[strlen(lpszPathName)-3], 3);
 		ext[3] = 0;
-		if (strcmp(ext, "img") != 0 && strcmp(ext, "hdr") != 0) {
+		if (strcmp(ext, "img") != 0 && strcmp(ext, "hdr") != 0 && strcmp(ext, "nii") != 0) {
 			strncpy(ext, (char*)&lpszPathName[strlen(lpszPathName)-6], 6);
 			ext[6] = 0;
 			if (strcmp(ext, "nii.gz") != 0) {
@@ -385,44 +421,7 @@ BOOL LoadNIIData(LPCTSTR lpszPathName, T***** pVoxelData, int& vd_x, int& vd_y,
 		return FALSE;
 	}
 
-	vd_x = pNII->nx;
-	vd_y = pNII->ny;
-	vd_z = pNII->nz;
-	if (pNII->nt > 1 || pNII->nu <= 1) {
-		vd_s = pNII->nt;
-	} else if (pNII->nt <= 1 || pNII->nu > 1) {
-		vd_s = pNII->nu;
-	} else {
-		vd_s = 1;
-	}
-	vd_dx = pNII->dx;
-	vd_dy = pNII->dy;
-	vd_dz = pNII->dz;
-	vd_ox = pNII->qoffset_x;
-	vd_oy = pNII->qoffset_y;
-	vd_oz = pNII->qoffset_z;
-	vd_oc = pNII->analyze75_orient;
-	//
-#ifndef USE_ASSUME_LPS
-	nifti_mat44_to_orientation(pNII->qto_ijk, &icod, &jcod, &kcod);
-	if (icod == NIFTI_R2L) {
-		si = 0;
-	} else {
-		si = 1;
-	}
-	if (jcod == NIFTI_A2P) {
-		sj = 0;
-	} else {
-		sj = 1;
-	}
-	if (kcod == NIFTI_I2S) {
-		sk = 0;
-	} else {
-		sk = 1;
-	}
-#else
-	si = sj = sk = 0;
-#endif
+	ParseNIIHeader(pNII, vd_x, vd_y, vd_z, vd_s, vd_dx, vd_dy, vd_dz, vd_ox, vd_oy, vd_oz, vd_oc, si, sj, sk);
 	//
 	if (!AllocateVoxelData(pVoxelData, vd_x, vd_y, vd_z, vd_s)) {
 		return FALSE;
@@ -530,6 +529,40 @@ errret:
 	return bRes;
 }
 
+template <class S, class T>
+inline void ConvertNIIMappedRow(const char* p, ptrdiff_t sx, int vd_x, int nl, T* pData)
+{
+	int i, l;
+
+	for (i = 0; i < vd_x; i++, p += sx) {
+		for (l = 0; l < nl; l++) {
+			pData[i*nl+l] = (T)((const S*)p)[l];
+		}
+	}
+}
+
+// Converts the first nl channels of the voxels of the row j of the slice k of
+// the mapping to pData, nl values per voxel, as LoadNIIData would
+template <class T>
+void ReadNIIMappedRow(const NIIMapping* mapping, int j, int k, int vd_x, int nl, T* pData)
+{
+	const char* p = mapping->origin + j*mapping->sy + k*mapping->sz;
+
+	if (mapping->nbyper == 1) {
+		ConvertNIIMappedRow<BYTE>(p, mapping->sx, vd_x, nl, pData);
+	} else if (mapping->datatype == DT_INT16) {
+		ConvertNIIMappedRow<short>(p, mapping->sx, vd_x, nl, pData);
+	} else if (mapping->datatype == DT_UINT16) {
+		ConvertNIIMappedRow<unsigned short>(p, mapping->sx, vd_x, nl, pData);
+	} else if (mapping->datatype == DT_FLOAT32) {
+		ConvertNIIMappedRow<float>(p, mapping->sx, vd_x, nl, pData);
+	} else if (mapping->datatype == DT_INT32) {
+		ConvertNIIMappedRow<int>(p, mapping->sx, vd_x, nl, pData);
+	} else {
+		ConvertNIIMappedRow<double>(p, mapping->sx, vd_x, nl, pData);
+	}
+}
+
 template <class T>
 BOOL LoadNIIDataV3D(char* vx_name, char* vy_name, char* vz_name, T***** pVoxelData, int& vd_x, int& vd_y, int& vd_z, int& vd_s, float& vd_dx, float& vd_dy, float& vd_dz, float& vd_ox, float& vd_oy, float& vd_oz, analyze_75_orient_code& vd_oc)
 {
@@ -0,0 +1,125 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernels.cpp
+// Scalar patch distance kernels and instruction set dispatch
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "NLMKernels.h"
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+struct VecScalar {
+	enum { W = 1 };
+	typedef nlm_real T;
+	static inline T zero() { return 0; }
+	static inline T load(const nlm_real* p) { return *p; }
+	static inline T loadn(const nlm_real*, int) { return 0; }
+	static inline T sub(T a, T b) { return a - b; }
+	static inline T fmadd(T a, T b, T c) { return c + a*b; }
+	static inline double hsum(T a) { return a; }
+};
+
+struct VecScalarD {
+	enum { W = 1 };
+	typedef double T;
+	static inline T set1(double a) { return a; }
+	static inline T load(const double* p) { return *p; }
+	static inline void store(double* p, T a) { *p = a; }
+	static inline T mul(T a, T b) { return a*b; }
+	static inline T fmadd(T a, T b, T c) { return c + a*b; }
+	static inline T min(T a, T b) { return (a < b) ? a : b; }
+	static inline T andle(T a, T b, T c) { return (b <= c) ? a : 0; }
+};
+}
+
+#include "NLMKernelsImpl.h"
+
+NLM_KERNEL_TABLE(g_NLMKernelsScalar, NLM_SIMD_NONE, "none", VecScalar, VecScalarD)
+
+static int GetCPUSimd()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return NLM_SIMD_AVX512;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		return NLM_SIMD_AVX2;
+	}
+	if (__builtin_cpu_supports("sse4.2")) {
+		return NLM_SIMD_SSE42;
+	}
+	return NLM_SIMD_NONE;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	unsigned long long xcr0 = 0;
+	bool sse42, avx, avx2, fma, avx512f;
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return NLM_SIMD_NONE;
+	}
+	__cpuid(info, 1);
+	sse42 = (info[2] & (1 << 20)) != 0;
+	fma   = (info[2] & (1 << 12)) != 0;
+	avx   = (info[2] & (1 << 28)) != 0 && (info[2] & (1 << 27)) != 0;
+	if (avx) {
+		xcr0 = _xgetbv(0);
+	}
+	__cpuidex(info, 7, 0);
+	avx2    = avx && (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0;
+	avx512f = avx && (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+	if (avx512f) {
+		return NLM_SIMD_AVX512;
+	}
+	if (avx2 && fma) {
+		return NLM_SIMD_AVX2;
+	}
+	if (sse42) {
+		return NLM_SIMD_SSE42;
+	}
+	return NLM_SIMD_NONE;
+#else
+	return NLM_SIMD_NONE;
+#endif
+}
+
+const NLMKernels* GetNLMKernels(int simd, int f)
+{
+	int cpu = GetCPUSimd();
+
+	if (simd == NLM_SIMD_AUTO || simd > cpu) {
+		simd = cpu;
+	}
+	if (f < 0 || f > NLM_KERNELS_MAX_F) {
+		f = 0;
+	}
+#ifdef NLM_HAVE_AVX512
+	if (simd >= NLM_SIMD_AVX512) {
+		return &g_NLMKernelsAVX512[f];
+	}
+#endif
+#ifdef NLM_HAVE_AVX2
+	if (simd >= NLM_SIMD_AVX2) {
+		return &g_NLMKernelsAVX2[f];
+	}
+#endif
+#ifdef NLM_HAVE_SSE42
+	if (simd >= NLM_SIMD_SSE42) {
+		return &g_NLMKernelsSSE42[f];
+	}
+#endif
+	return &g_NLMKernelsScalar[f];
+}
+
+int ParseNLMSimd(const char* name)
+{
+	if (strcmp(name, "auto"  ) == 0) return NLM_SIMD_AUTO;
+	if (strcmp(name, "none"  ) == 0) return NLM_SIMD_NONE;
+	if (strcmp(name, "sse42" ) == 0) return NLM_SIMD_SSE42;
+	if (strcmp(name, "avx2"  ) == 0) return NLM_SIMD_AVX2;
+	if (strcmp(name, "avx512") == 0) return NLM_SIMD_AVX512;
+	return -2;
+}
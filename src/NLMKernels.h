@@ -0,0 +1,71 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernels.h
+// Patch distance kernels of naonlm3d with SSE4.2, AVX2 and AVX-512 variants
+///////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Element type of the image volumes. Building with NLM_FLOAT32 (cmake option
+// NAONLM3D_FLOAT32) runs the pipeline in single precision, the distances are
+// still returned in double and the weights and estimates accumulated in double.
+#ifdef NLM_FLOAT32
+typedef float nlm_real;
+#else
+typedef double nlm_real;
+#endif
+
+enum {
+	NLM_SIMD_AUTO = -1,
+	NLM_SIMD_NONE = 0,
+	NLM_SIMD_SSE42,
+	NLM_SIMD_AVX2,
+	NLM_SIMD_AVX512,
+};
+
+// Compares a packed center patch c against ncand candidate patches. The center
+// patch is stored as (2f+1)^2 contiguous rows of 2f+1 values. The first voxel
+// of the m-th candidate patch is p[off[m]], its rows are sx apart and its
+// planes sxy apart. Both distances, mean squared differences, come from one
+// pass over the patches: the one of the intensities, and the one of the mean
+// subtracted intensities p[..]-q[..] against c2, the packed mean subtracted
+// center patch. Returns the minimum of dmin and of the mean subtracted
+// distances, d[m] receiving the distance of the m-th candidate, or a partial
+// one above 3*max(dmin, 1) when the candidate can neither get a weight nor
+// lower the minimum.
+typedef double (*NLMDistancesFunc)(const nlm_real* c, const nlm_real* c2, const nlm_real* p, const nlm_real* q, const int* off, int ncand, int f, int sx, int sxy, double dmin, double* d);
+
+// Weights of candidates at the distances d[0..n-1] from a block whose minimum
+// distance is dmin: w[m] = exp(-d[m]/dmin) if d[m] <= 3*dmin, 0 otherwise.
+typedef void (*NLMWeightsFunc)(const double* d, int n, double dmin, double* w);
+
+// largest patch radius with specialized kernels
+#define NLM_KERNELS_MAX_F 3
+
+typedef struct {
+	int simd;
+	const char* name;
+	// patch radius the kernels are specialized for, 0 if they take any f
+	int f;
+	NLMDistancesFunc distances;
+	NLMWeightsFunc weights;
+} NLMKernels;
+
+// Returns the kernels of the requested instruction set, or of the best one
+// supported by the compiler and the running CPU when simd is NLM_SIMD_AUTO or
+// not available, specialized for the patch radius f when there are some.
+const NLMKernels* GetNLMKernels(int simd, int f);
+// Returns NLM_SIMD_* of name ("auto", "none", "sse42", "avx2", "avx512"), or -2 if unknown.
+int ParseNLMSimd(const char* name);
+
+// per instruction set kernel tables, defined in NLMKernels_*.cpp, indexed by
+// the patch radius (0 for the generic kernels)
+extern const NLMKernels g_NLMKernelsScalar[NLM_KERNELS_MAX_F+1];
+#ifdef NLM_HAVE_SSE42
+extern const NLMKernels g_NLMKernelsSSE42[NLM_KERNELS_MAX_F+1];
+#endif
+#ifdef NLM_HAVE_AVX2
+extern const NLMKernels g_NLMKernelsAVX2[NLM_KERNELS_MAX_F+1];
+#endif
+#ifdef NLM_HAVE_AVX512
+extern const NLMKernels g_NLMKernelsAVX512[NLM_KERNELS_MAX_F+1];
+#endif
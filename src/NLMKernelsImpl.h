@@ -0,0 +1,201 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernelsImpl.h
+// Instruction set independent body of the patch distance kernels
+///////////////////////////////////////////////////////////////////////////////////////
+
+// This file is included by every NLMKernels_*.cpp after the definition of a
+// vector type V providing
+//   W                    : number of nlm_real per vector
+//   T                    : vector type
+//   zero()               : all zero vector
+//   load(p)              : W unaligned nlm_real
+//   loadn(p, n)          : n < W nlm_real, remaining lanes set to zero
+//   sub(a, b), fmadd(a, b, c) = a*b+c, hsum(a)
+// and of a vector type D of doubles for the weights providing
+//   W, T, set1(a), load(p), store(p, a), mul(a, b), fmadd(a, b, c),
+//   min(a, b)
+//   andle(a, b, c)       : a where b <= c, 0 elsewhere
+// Everything is kept in an anonymous namespace so that the same templates
+// compiled with different instruction set flags never get merged by the linker.
+// The kernels are instantiated for the patch radii F = 1..NLM_KERNELS_MAX_F,
+// whose loops have fixed trip counts, and F = 0 for any radius f.
+
+#include "NLMKernels.h"
+
+namespace {
+
+// number of candidates sharing one load of a center patch row
+#define NLM_CAND_CHUNK 8
+
+// Both distances of the candidates, see NLMDistancesFunc, from a single read
+// of their intensity and mean rows. Partial sums of squares only grow, so
+// once a plane of the patches is summed, a candidate whose partial distance
+// already exceeds 3*max(dmin, 1) and whose partial mean subtracted distance
+// exceeds dmin is dropped from the chunk: it can neither lower the minimum
+// nor get a weight, whatever value above the cutoff its distance ends with.
+// In single precision the vector sums only cover one plane of the patches,
+// the planes being added in double.
+template <class V, int F>
+double PatchDistances(const nlm_real* c, const nlm_real* c2, const nlm_real* p, const nlm_real* q, const int* off, int ncand, int f, int sx, int sxy, double dmin, double* d)
+{
+	const int n = 2*(F ? F : f)+1;
+	const int nv = n / V::W;
+	const int nt = n - nv*V::W;
+	const double acu = (double)(n*n*n);
+	typename V::T acc[NLM_CAND_CHUNK], acc2[NLM_CAND_CHUNK], cv, cv2, pv, t;
+	int o[NLM_CAND_CHUNK], idx[NLM_CAND_CHUNK];
+	int m, m0, na, a, b, l, ro, e;
+	double s, s2, limit, limit2;
+#ifdef NLM_FLOAT32
+	double ds[NLM_CAND_CHUNK], ds2[NLM_CAND_CHUNK];
+#endif
+
+	for (m0 = 0; m0 < ncand; m0 += NLM_CAND_CHUNK) {
+		na = MIN(NLM_CAND_CHUNK, ncand-m0);
+		for (m = 0; m < na; m++) {
+			acc[m] = V::zero();
+			acc2[m] = V::zero();
+#ifdef NLM_FLOAT32
+			ds[m] = 0.0;
+			ds2[m] = 0.0;
+#endif
+			o[m] = off[m0+m];
+			idx[m] = m0+m;
+		}
+		// the final minimum is at most the current one, or 1 if it becomes 0
+		limit2 = dmin;
+		limit = 3*MAX(dmin, 1.0);
+		for (b = 0; b < n && na > 0; b++) {
+			for (a = 0; a < n; a++) {
+				const nlm_real* cr = c + (b*n+a)*n;
+				const nlm_real* cr2 = c2 + (b*n+a)*n;
+				ro = b*sxy + a*sx;
+				for (l = 0; l < nv; l++) {
+					cv = V::load(cr + l*V::W);
+					cv2 = V::load(cr2 + l*V::W);
+					for (m = 0; m < na; m++) {
+						e = o[m] + ro + l*V::W;
+						pv = V::load(p + e);
+						t = V::sub(cv, pv);
+						acc[m] = V::fmadd(t, t, acc[m]);
+						t = V::sub(cv2, V::sub(pv, V::load(q + e)));
+						acc2[m] = V::fmadd(t, t, acc2[m]);
+					}
+				}
+				if (nt > 0) {
+					cv = V::loadn(cr + nv*V::W, nt);
+					cv2 = V::loadn(cr2 + nv*V::W, nt);
+					for (m = 0; m < na; m++) {
+						e = o[m] + ro + nv*V::W;
+						pv = V::loadn(p + e, nt);
+						t = V::sub(cv, pv);
+						acc[m] = V::fmadd(t, t, acc[m]);
+						t = V::sub(cv2, V::sub(pv, V::loadn(q + e, nt)));
+						acc2[m] = V::fmadd(t, t, acc2[m]);
+					}
+				}
+			}
+			// the candidates which can neither be the minimum nor get a weight
+			// are dropped, the last one of the chunk taking their place
+			for (m = 0; m < na; ) {
+#ifdef NLM_FLOAT32
+				ds[m] += V::hsum(acc[m]);
+				ds2[m] += V::hsum(acc2[m]);
+				acc[m] = V::zero();
+				acc2[m] = V::zero();
+				s = ds[m] / acu;
+				s2 = ds2[m] / acu;
+#else
+				s = V::hsum(acc[m]) / acu;
+				s2 = V::hsum(acc2[m]) / acu;
+#endif
+				if (b == n-1 || (s > limit && s2 > limit2)) {
+					d[idx[m]] = s;
+					if (b == n-1 && s2 < dmin) {
+						dmin = s2;
+					}
+					na--;
+					acc[m] = acc[na];
+					acc2[m] = acc2[na];
+#ifdef NLM_FLOAT32
+					ds[m] = ds[na];
+					ds2[m] = ds2[na];
+#endif
+					o[m] = o[na];
+					idx[m] = idx[na];
+				} else {
+					m++;
+				}
+			}
+		}
+	}
+	return dmin;
+}
+
+// exp(-x) for 0 <= x <= 3, as the degree 12 Taylor polynomial of exp(-x/8)
+// raised to the power 8. Against libm exp its relative error is below 7e-15
+// (about 31 ulp) over the whole interval, with or without FMA.
+template <class D>
+static inline typename D::T Exp_neg3(typename D::T x)
+{
+	typename D::T y = D::mul(x, D::set1(-0.125)), e;
+
+	e = D::set1(1.0/479001600);
+	e = D::fmadd(e, y, D::set1(1.0/39916800));
+	e = D::fmadd(e, y, D::set1(1.0/3628800));
+	e = D::fmadd(e, y, D::set1(1.0/362880));
+	e = D::fmadd(e, y, D::set1(1.0/40320));
+	e = D::fmadd(e, y, D::set1(1.0/5040));
+	e = D::fmadd(e, y, D::set1(1.0/720));
+	e = D::fmadd(e, y, D::set1(1.0/120));
+	e = D::fmadd(e, y, D::set1(1.0/24));
+	e = D::fmadd(e, y, D::set1(1.0/6));
+	e = D::fmadd(e, y, D::set1(0.5));
+	e = D::fmadd(e, y, D::set1(1.0));
+	e = D::fmadd(e, y, D::set1(1.0));
+	e = D::mul(e, e);
+	e = D::mul(e, e);
+	return D::mul(e, e);
+}
+
+// Weight of the distances d, r being 1/dmin and t 3*dmin. x is clamped so that
+// the lanes which get 0 stay finite.
+template <class D>
+static inline typename D::T Weight(typename D::T d, typename D::T r, typename D::T t)
+{
+	return D::andle(Exp_neg3<D>(D::min(D::mul(d, r), D::set1(4.0))), d, t);
+}
+
+// The last n % W weights go through a zero padded vector, so that a weight
+// never depends on its position in the batch.
+template <class D>
+void Weights(const double* d, int n, double dmin, double* w)
+{
+	const typename D::T r = D::set1(1.0/dmin), t = D::set1(3*dmin);
+	double dt[D::W], wt[D::W];
+	int m, l;
+
+	for (m = 0; m + D::W <= n; m += D::W) {
+		D::store(w + m, Weight<D>(D::load(d + m), r, t));
+	}
+	if (m < n) {
+		for (l = 0; l < D::W; l++) {
+			dt[l] = (m + l < n) ? d[m+l] : 0;
+		}
+		D::store(wt, Weight<D>(D::load(dt), r, t));
+		for (l = 0; m + l < n; l++) {
+			w[m+l] = wt[l];
+		}
+	}
+}
+
+} // namespace
+
+// Defines the kernel table name[NLM_KERNELS_MAX_F+1] of the vector types V and D
+#define NLM_KERNEL_TABLE(name, simd, simd_name, V, D) \
+const NLMKernels name[NLM_KERNELS_MAX_F+1] = { \
+	{ simd, simd_name, 0, PatchDistances<V, 0>, Weights<D> }, \
+	{ simd, simd_name, 1, PatchDistances<V, 1>, Weights<D> }, \
+	{ simd, simd_name, 2, PatchDistances<V, 2>, Weights<D> }, \
+	{ simd, simd_name, 3, PatchDistances<V, 3>, Weights<D> }, \
+};
@@ -0,0 +1,76 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernels_AVX2.cpp
+// AVX2 patch distance kernels (compiled with -mavx2 -mfma)
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include <immintrin.h>
+
+namespace {
+#ifdef NLM_FLOAT32
+// lane masks of _mm256_maskload_ps for 0..7 valid elements
+static const int s_mask_avx2[8][8] = {
+	{  0,  0,  0,  0,  0,  0,  0,  0 },
+	{ -1,  0,  0,  0,  0,  0,  0,  0 },
+	{ -1, -1,  0,  0,  0,  0,  0,  0 },
+	{ -1, -1, -1,  0,  0,  0,  0,  0 },
+	{ -1, -1, -1, -1,  0,  0,  0,  0 },
+	{ -1, -1, -1, -1, -1,  0,  0,  0 },
+	{ -1, -1, -1, -1, -1, -1,  0,  0 },
+	{ -1, -1, -1, -1, -1, -1, -1,  0 },
+};
+
+struct VecAVX2 {
+	enum { W = 8 };
+	typedef __m256 T;
+	static inline T zero() { return _mm256_setzero_ps(); }
+	static inline T load(const float* p) { return _mm256_loadu_ps(p); }
+	static inline T loadn(const float* p, int n) { return _mm256_maskload_ps(p, _mm256_loadu_si256((const __m256i*)s_mask_avx2[n])); }
+	static inline T sub(T a, T b) { return _mm256_sub_ps(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm256_fmadd_ps(a, b, c); }
+	static inline double hsum(T a) {
+		__m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+		s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+		return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+	}
+};
+#else
+// lane masks of _mm256_maskload_pd for 0..3 valid elements
+static const long long s_mask_avx2[4][4] = {
+	{  0,  0,  0,  0 },
+	{ -1,  0,  0,  0 },
+	{ -1, -1,  0,  0 },
+	{ -1, -1, -1,  0 },
+};
+
+struct VecAVX2 {
+	enum { W = 4 };
+	typedef __m256d T;
+	static inline T zero() { return _mm256_setzero_pd(); }
+	static inline T load(const double* p) { return _mm256_loadu_pd(p); }
+	static inline T loadn(const double* p, int n) { return _mm256_maskload_pd(p, _mm256_loadu_si256((const __m256i*)s_mask_avx2[n])); }
+	static inline T sub(T a, T b) { return _mm256_sub_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm256_fmadd_pd(a, b, c); }
+	static inline double hsum(T a) {
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+};
+#endif
+
+struct VecAVX2D {
+	enum { W = 4 };
+	typedef __m256d T;
+	static inline T set1(double a) { return _mm256_set1_pd(a); }
+	static inline T load(const double* p) { return _mm256_loadu_pd(p); }
+	static inline void store(double* p, T a) { _mm256_storeu_pd(p, a); }
+	static inline T mul(T a, T b) { return _mm256_mul_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm256_fmadd_pd(a, b, c); }
+	static inline T min(T a, T b) { return _mm256_min_pd(a, b); }
+	static inline T andle(T a, T b, T c) { return _mm256_and_pd(a, _mm256_cmp_pd(b, c, _CMP_LE_OQ)); }
+};
+}
+
+#include "NLMKernelsImpl.h"
+
+NLM_KERNEL_TABLE(g_NLMKernelsAVX2, NLM_SIMD_AVX2, "avx2", VecAVX2, VecAVX2D)
@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernels_AVX512.cpp
+// AVX-512 patch distance kernels (compiled with -mavx512f)
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include <immintrin.h>
+
+namespace {
+#ifdef NLM_FLOAT32
+struct VecAVX512 {
+	enum { W = 16 };
+	typedef __m512 T;
+	static inline T zero() { return _mm512_setzero_ps(); }
+	static inline T load(const float* p) { return _mm512_loadu_ps(p); }
+	static inline T loadn(const float* p, int n) { return _mm512_maskz_loadu_ps((__mmask16)((1u << n) - 1), p); }
+	static inline T sub(T a, T b) { return _mm512_sub_ps(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm512_fmadd_ps(a, b, c); }
+	// _mm512_reduce_add_ps with zero-masked extracts, see VecAVX512D::min
+	static inline double hsum(T a) {
+		__m256 h = _mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(a), 1)), _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(a), 0)));
+		__m128 q = _mm_add_ps(_mm256_extractf128_ps(h, 1), _mm256_castps256_ps128(h));
+		q = _mm_add_ps(q, _mm_movehl_ps(q, q));
+		return _mm_cvtss_f32(_mm_add_ss(q, _mm_shuffle_ps(q, q, 1)));
+	}
+};
+#else
+struct VecAVX512 {
+	enum { W = 8 };
+	typedef __m512d T;
+	static inline T zero() { return _mm512_setzero_pd(); }
+	static inline T load(const double* p) { return _mm512_loadu_pd(p); }
+	static inline T loadn(const double* p, int n) { return _mm512_maskz_loadu_pd((__mmask8)((1u << n) - 1), p); }
+	static inline T sub(T a, T b) { return _mm512_sub_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm512_fmadd_pd(a, b, c); }
+	// _mm512_reduce_add_pd with zero-masked extracts, see VecAVX512D::min
+	static inline double hsum(T a) {
+		__m256d h = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, a, 1), _mm512_maskz_extractf64x4_pd(0xF, a, 0));
+		__m128d q = _mm_add_pd(_mm256_extractf128_pd(h, 1), _mm256_castpd256_pd128(h));
+		return _mm_cvtsd_f64(_mm_add_sd(q, _mm_unpackhi_pd(q, q)));
+	}
+};
+#endif
+
+struct VecAVX512D {
+	enum { W = 8 };
+	typedef __m512d T;
+	static inline T set1(double a) { return _mm512_set1_pd(a); }
+	static inline T load(const double* p) { return _mm512_loadu_pd(p); }
+	static inline void store(double* p, T a) { _mm512_storeu_pd(p, a); }
+	static inline T mul(T a, T b) { return _mm512_mul_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm512_fmadd_pd(a, b, c); }
+	// the unmasked forms pass an uninitialized vector as their source, which
+	// GCC reports as maybe-uninitialized
+	static inline T min(T a, T b) { return _mm512_maskz_min_pd(0xFF, a, b); }
+	static inline T andle(T a, T b, T c) { return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(b, c, _CMP_LE_OQ), a); }
+};
+}
+
+#include "NLMKernelsImpl.h"
+
+NLM_KERNEL_TABLE(g_NLMKernelsAVX512, NLM_SIMD_AVX512, "avx512", VecAVX512, VecAVX512D)
@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMKernels_SSE42.cpp
+// SSE4.2 patch distance kernels (compiled with -msse4.2)
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include <nmmintrin.h>
+
+namespace {
+#ifdef NLM_FLOAT32
+struct VecSSE42 {
+	enum { W = 4 };
+	typedef __m128 T;
+	static inline T zero() { return _mm_setzero_ps(); }
+	static inline T load(const float* p) { return _mm_loadu_ps(p); }
+	static inline T loadn(const float* p, int n) {
+		if (n == 1) return _mm_load_ss(p);
+		if (n == 2) return _mm_castpd_ps(_mm_load_sd((const double*)p));
+		return _mm_movelh_ps(_mm_castpd_ps(_mm_load_sd((const double*)p)), _mm_load_ss(p+2));
+	}
+	static inline T sub(T a, T b) { return _mm_sub_ps(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm_add_ps(c, _mm_mul_ps(a, b)); }
+	static inline double hsum(T a) {
+		a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+		return _mm_cvtss_f32(_mm_add_ss(a, _mm_shuffle_ps(a, a, 1)));
+	}
+};
+#else
+struct VecSSE42 {
+	enum { W = 2 };
+	typedef __m128d T;
+	static inline T zero() { return _mm_setzero_pd(); }
+	static inline T load(const double* p) { return _mm_loadu_pd(p); }
+	static inline T loadn(const double* p, int) { return _mm_load_sd(p); }
+	static inline T sub(T a, T b) { return _mm_sub_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm_add_pd(c, _mm_mul_pd(a, b)); }
+	static inline double hsum(T a) { return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a))); }
+};
+#endif
+
+struct VecSSE42D {
+	enum { W = 2 };
+	typedef __m128d T;
+	static inline T set1(double a) { return _mm_set1_pd(a); }
+	static inline T load(const double* p) { return _mm_loadu_pd(p); }
+	static inline void store(double* p, T a) { _mm_storeu_pd(p, a); }
+	static inline T mul(T a, T b) { return _mm_mul_pd(a, b); }
+	static inline T fmadd(T a, T b, T c) { return _mm_add_pd(c, _mm_mul_pd(a, b)); }
+	static inline T min(T a, T b) { return _mm_min_pd(a, b); }
+	static inline T andle(T a, T b, T c) { return _mm_and_pd(a, _mm_cmple_pd(b, c)); }
+};
+}
+
+#include "NLMKernelsImpl.h"
+
+NLM_KERNEL_TABLE(g_NLMKernelsSSE42, NLM_SIMD_SSE42, "sse42", VecSSE42, VecSSE42D)
@@ -0,0 +1,362 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMThreads.cpp
+// Thread pool, mutexes and the work-stealing tile scheduler of naonlm3d
+///////////////////////////////////////////////////////////////////////////////////////
+
+#include "stdafx.h"
+#include "MyUtils.h"
+#include "NLMThreads.h"
+
+void Mutex_init(NLMMutex* m)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(m);
+#else
+	pthread_mutex_init(m, NULL);
+#endif
+}
+
+void Mutex_lock(NLMMutex* m)
+{
+#ifdef _WIN32
+	EnterCriticalSection(m);
+#else
+	pthread_mutex_lock(m);
+#endif
+}
+
+void Mutex_unlock(NLMMutex* m)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(m);
+#else
+	pthread_mutex_unlock(m);
+#endif
+}
+
+void Mutex_destroy(NLMMutex* m)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(m);
+#else
+	pthread_mutex_destroy(m);
+#endif
+}
+
+static void Cond_init(NLMCond* c)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(c);
+#else
+	pthread_cond_init(c, NULL);
+#endif
+}
+
+static void Cond_wait(NLMCond* c, NLMMutex* m)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(c, m, INFINITE);
+#else
+	pthread_cond_wait(c, m);
+#endif
+}
+
+static void Cond_broadcast(NLMCond* c)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(c);
+#else
+	pthread_cond_broadcast(c);
+#endif
+}
+
+static void Cond_destroy(NLMCond* c)
+{
+	// the condition variables of Windows need no cleanup
+#ifndef _WIN32
+	pthread_cond_destroy(c);
+#endif
+}
+
+int Number_of_cpus()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return MAX(1, (int)info.dwNumberOfProcessors);
+#else
+	return MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+}
+
+typedef struct {
+	NLMPool* pool;
+	int worker;
+} NLMWorker;
+
+struct NLMPool {
+	int nthreads;
+#ifdef _WIN32
+	HANDLE* threads;
+#else
+	pthread_t* threads;
+#endif
+	NLMWorker* workers;
+	NLMMutex lock;
+	// a new job is posted by incrementing generation, pending counts the
+	// threads which have not finished it yet
+	NLMCond start;
+	NLMCond done;
+	int generation;
+	int pending;
+	bool quit;
+	NLMTask func;
+	char* args;
+	size_t size;
+};
+
+#ifdef _WIN32
+static unsigned __stdcall Pool_thread(void* p)
+#else
+static void* Pool_thread(void* p)
+#endif
+{
+	NLMWorker* worker = (NLMWorker*)p;
+	NLMPool* pool = worker->pool;
+	int generation = 0;
+
+	for (;;) {
+		Mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->quit) {
+			Cond_wait(&pool->start, &pool->lock);
+		}
+		if (pool->quit) {
+			Mutex_unlock(&pool->lock);
+			break;
+		}
+		generation = pool->generation;
+		Mutex_unlock(&pool->lock);
+
+		pool->func(pool->args + worker->worker*pool->size);
+
+		Mutex_lock(&pool->lock);
+		if (--pool->pending == 0) {
+			Cond_broadcast(&pool->done);
+		}
+		Mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+NLMPool* Pool_create(int nthreads)
+{
+	NLMPool* pool = (NLMPool*)calloc(1, sizeof(NLMPool));
+	int i;
+
+	pool->nthreads = (nthreads > 0) ? nthreads : Number_of_cpus();
+	Mutex_init(&pool->lock);
+	Cond_init(&pool->start);
+	Cond_init(&pool->done);
+	pool->workers = (NLMWorker*)calloc(pool->nthreads, sizeof(NLMWorker));
+#ifdef _WIN32
+	pool->threads = (HANDLE*)calloc(pool->nthreads, sizeof(HANDLE));
+#else
+	pool->threads = (pthread_t*)calloc(pool->nthreads, sizeof(pthread_t));
+#endif
+	for (i = 1; i < pool->nthreads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].worker = i;
+#ifdef _WIN32
+		pool->threads[i] = (HANDLE)_beginthreadex(NULL, 0, Pool_thread, &pool->workers[i], 0, NULL);
+		if (pool->threads[i] == 0) {
+#else
+		if (pthread_create(&pool->threads[i], NULL, Pool_thread, &pool->workers[i])) {
+#endif
+			TRACE("Threads cannot be created\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return pool;
+}
+
+int Pool_size(const NLMPool* pool)
+{
+	return pool->nthreads;
+}
+
+void Pool_run(NLMPool* pool, NLMTask func, void* args, size_t size)
+{
+	Mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->args = (char*)args;
+	pool->size = size;
+	pool->pending = pool->nthreads-1;
+	pool->generation++;
+	Cond_broadcast(&pool->start);
+	Mutex_unlock(&pool->lock);
+
+	func(args);
+
+	Mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		Cond_wait(&pool->done, &pool->lock);
+	}
+	Mutex_unlock(&pool->lock);
+}
+
+// parallel loop shared by the workers of Pool_for
+typedef struct {
+	NLMRangeTask func;
+	void* arg;
+	int n;
+	int chunk;
+	int next;
+	NLMMutex lock;
+} NLMRange;
+
+static void Range_task(void* p)
+{
+	NLMRange* range = *(NLMRange**)p;
+	int i0;
+
+	for (;;) {
+		Mutex_lock(&range->lock);
+		i0 = range->next;
+		range->next += range->chunk;
+		Mutex_unlock(&range->lock);
+		if (i0 >= range->n) {
+			break;
+		}
+		range->func(range->arg, i0, MIN(range->n, i0+range->chunk));
+	}
+}
+
+void Pool_for(NLMPool* pool, int n, NLMRangeTask func, void* arg)
+{
+	NLMRange range;
+	NLMRange* p = &range;
+
+	if (n <= 0) {
+		return;
+	}
+	if (pool->nthreads == 1) {
+		func(arg, 0, n);
+		return;
+	}
+	// a few chunks per thread balance the load without much locking
+	range.func = func;
+	range.arg = arg;
+	range.n = n;
+	range.chunk = MAX(1, n / (4*pool->nthreads));
+	range.next = 0;
+	Mutex_init(&range.lock);
+	Pool_run(pool, Range_task, &p, 0);
+	Mutex_destroy(&range.lock);
+}
+
+// loop of Pool_for_range, its indices shifted by i0
+typedef struct {
+	NLMRangeTask func;
+	void* arg;
+	int i0;
+} NLMOffsetRange;
+
+static void Offset_task(void* p, int i0, int i1)
+{
+	NLMOffsetRange* range = (NLMOffsetRange*)p;
+
+	range->func(range->arg, range->i0 + i0, range->i0 + i1);
+}
+
+void Pool_for_range(NLMPool* pool, int i0, int i1, NLMRangeTask func, void* arg)
+{
+	NLMOffsetRange range = { func, arg, i0 };
+
+	Pool_for(pool, i1-i0, Offset_task, &range);
+}
+
+void Pool_free(NLMPool* pool)
+{
+	int i;
+
+	Mutex_lock(&pool->lock);
+	pool->quit = true;
+	Cond_broadcast(&pool->start);
+	Mutex_unlock(&pool->lock);
+	for (i = 1; i < pool->nthreads; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], NULL);
+#endif
+	}
+	Cond_destroy(&pool->start);
+	Cond_destroy(&pool->done);
+	Mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool->threads);
+	free(pool);
+}
+
+void Scheduler_init(NLMScheduler* s, int nworkers, int max_tiles)
+{
+	int w;
+
+	s->nworkers = nworkers;
+	s->tiles = (int*)MyAlloc(MAX(max_tiles, 1) * sizeof(int));
+	s->head = (int*)MyAlloc(nworkers * sizeof(int));
+	s->tail = (int*)MyAlloc(nworkers * sizeof(int));
+	s->lock = (NLMMutex*)MyAlloc(nworkers * sizeof(NLMMutex));
+	for (w = 0; w < nworkers; w++) {
+		s->head[w] = 0;
+		s->tail[w] = 0;
+		Mutex_init(&s->lock[w]);
+	}
+}
+
+void Scheduler_fill(NLMScheduler* s, const int* tiles, int ntiles)
+{
+	int w;
+
+	memcpy(s->tiles, tiles, ntiles * sizeof(int));
+	for (w = 0; w < s->nworkers; w++) {
+		s->head[w] = (int)(((long long)w*ntiles) / s->nworkers);
+		s->tail[w] = (int)(((long long)(w+1)*ntiles) / s->nworkers);
+	}
+}
+
+int Scheduler_next(NLMScheduler* s, int w)
+{
+	int i, v, t = -1;
+
+	Mutex_lock(&s->lock[w]);
+	if (s->head[w] < s->tail[w]) {
+		t = s->tiles[s->head[w]++];
+	}
+	Mutex_unlock(&s->lock[w]);
+	// steal from the back of the other deques, in turn
+	for (i = 1; t < 0 && i < s->nworkers; i++) {
+		v = (w+i) % s->nworkers;
+		Mutex_lock(&s->lock[v]);
+		if (s->head[v] < s->tail[v]) {
+			t = s->tiles[--s->tail[v]];
+		}
+		Mutex_unlock(&s->lock[v]);
+	}
+	return t;
+}
+
+void Scheduler_free(NLMScheduler* s)
+{
+	int w;
+
+	for (w = 0; w < s->nworkers; w++) {
+		Mutex_destroy(&s->lock[w]);
+	}
+	MyFree(s->tiles);
+	MyFree(s->head);
+	MyFree(s->tail);
+	MyFree(s->lock);
+}
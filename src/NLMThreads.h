@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////////////
+// NLMThreads.h
+// Thread pool, mutexes and the work-stealing tile scheduler of naonlm3d
+///////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION NLMMutex;
+typedef CONDITION_VARIABLE NLMCond;
+#else
+typedef pthread_mutex_t NLMMutex;
+typedef pthread_cond_t NLMCond;
+#endif
+
+// Task run by every thread of a pool on its own argument
+typedef void (*NLMTask)(void* arg);
+// Task run on the indices [i0, i1) of a parallel loop
+typedef void (*NLMRangeTask)(void* arg, int i0, int i1);
+
+// Pool of threads created once and reused by every stage of the pipeline. The
+// calling thread is worker 0, the pool starts nthreads-1 more.
+typedef struct NLMPool NLMPool;
+
+// Returns a pool of nthreads threads, or of Number_of_cpus() if nthreads <= 0
+NLMPool* Pool_create(int nthreads);
+int Pool_size(const NLMPool* pool);
+// Runs func on every worker i, on the argument at args+i*size, and waits for
+// all of them
+void Pool_run(NLMPool* pool, NLMTask func, void* args, size_t size);
+// Runs func over [0, n) split in chunks which the workers take in turn, and
+// waits for all of them
+void Pool_for(NLMPool* pool, int n, NLMRangeTask func, void* arg);
+// Same as Pool_for over [i0, i1)
+void Pool_for_range(NLMPool* pool, int i0, int i1, NLMRangeTask func, void* arg);
+void Pool_free(NLMPool* pool);
+// Returns the number of available CPUs
+int Number_of_cpus();
+
+void Mutex_init(NLMMutex* m);
+void Mutex_lock(NLMMutex* m);
+void Mutex_unlock(NLMMutex* m);
+void Mutex_destroy(NLMMutex* m);
+
+// Work-stealing scheduler of a list of tiles. Every worker owns a deque, a
+// contiguous part of the list: it takes its tiles from the front, and once
+// it is empty steals the last tile of the other workers' deques.
+typedef struct {
+	int nworkers;
+	int* tiles;
+	int* head;
+	int* tail;
+	NLMMutex* lock;
+} NLMScheduler;
+
+void Scheduler_init(NLMScheduler* s, int nworkers, int max_tiles);
+// Shares the ntiles tiles out among the deques, replacing their content
+void Scheduler_fill(NLMScheduler* s, const int* tiles, int ntiles);
+// Returns the next tile of worker w, or -1 when every deque is empty
+int Scheduler_next(NLMScheduler* s, int w);
+void Scheduler_free(NLMScheduler* s);
@@ -26,34 +26,72 @@
 #include <float.h>
 #include "MyUtils.h"
 #include "Volume.h"
-
-// Multithreading stuff
-#ifdef _WIN32
-#include <windows.h>
-#include <process.h>
-#else
-#include <pthread.h>
-#endif
+#include "NLMKernels.h"
+#include "NLMThreads.h"
 
 #define pi 3.1415926535
 
-typedef struct{
+// The blocks, centered every stride voxels (every second one by default, see
+// -d), are filtered by cubic tiles spanning at least NLM_TILE_VOXELS voxels and
+// 2f along each axis, so that the patches of two tiles whose coordinates have
+// the same parities never overlap. The tiles are filtered in 8 phases, one per
+// parity, each phase sharing its tiles among the threads with work stealing.
+// The aggregation is thus free of races and its result independent of the
+// number of threads.
+#define NLM_TILE_VOXELS 16
+
+// states of the blocks of the lattice, see Block_lattice
+enum {
+	NLM_BLOCK_NONE = 0,		// left out by the adaptive stride
+	NLM_BLOCK_BACKGROUND,	// far from the foreground, see Background_blocks
+	NLM_BLOCK_ACTIVE,
+};
+
+// Number of blocks whose patch covers a voxel, at most (2f+1)^3 with the
+// stride 1, which fits for f up to NLM_MAX_PATCH
+typedef unsigned short nlm_count;
+#define NLM_MAX_PATCH 19
+
+// Box [x0, x1) x [y0, y1) x [z0, z1) of voxels, empty when x0 >= x1
+typedef struct {
+	int x0, x1, y0, y1, z0, z1;
+} voxelbox;
+
+typedef struct myargument myargument;
+struct myargument {
 	int rows;
 	int cols;
 	int slices;
-	double *in_image;
-	double *means_image;
-	double *var_image;
+	nlm_real *in_image;
+	nlm_real *means_image;
+	nlm_real *var_image;
+	// v+f, the halo of the tile buffers, see Tile_buffer_fill
+	int pad;
 	double *estimate;
-	double *label;
-	double *bias;
-	int ini;
-	int fin;
+	nlm_count *label;
+	// blocks (stride*bi, stride*bj, stride*bk), bi < nbx, bj < nby, bk < nbz,
+	// grouped in tiles of tile^3 blocks, ntx by nty per tile plane, which the
+	// thread worker takes from sched
+	int stride;
+	int nbx, nby, nbz;
+	int tile;
+	int ntx, nty;
+	NLMScheduler *sched;
+	int worker;
+	// minimum distance of each block (-1 if not filtered), see Block_bias
+	double *bdmin;
+	// raster index of the first block which is not filtered
+	ptrdiff_t first_skipped;
+	// NLM_BLOCK_* of each block
+	const unsigned char *state;
 	int radioB;
 	int radioS;
 	bool rician;
 	double max_val;
-} myargument;
+	const NLMKernels* kernels;
+	// block loop, see Get_block_filter
+	void (*filter)(const myargument* arg);
+};
 
 // Returns the modified Bessel function I0(x) for any real x.
 double bessi0(double x)
@@ -101,15 +139,49 @@ double Epsi(double snr)
 	return val;
 }
 
-// Function which compute the weighted average for one block
-void Average_block(double *ima, int x, int y, int z, int neighborhoodsize, double *average, double weight, int sx, int sy, int sz, bool rician)
+// Epsi is tabulated every 1/NLM_EPSI_STEPS over [0, NLM_EPSI_MAX_SNR], where it
+// is smooth, and evaluated above, where it gets clamped. Epsi only depends on
+// snr^2. The linear interpolation is within 1e-6 of Epsi.
+#define NLM_EPSI_STEPS   256
+#define NLM_EPSI_MAX_SNR 32
+#define NLM_EPSI_SIZE    (NLM_EPSI_MAX_SNR*NLM_EPSI_STEPS + 1)
+
+// Returns the table of Epsi read by Epsi_lookup
+double* Epsi_table()
+{
+	double* table = (double*)MyAlloc(NLM_EPSI_SIZE * sizeof(double));
+	int n;
+
+	for (n = 0; n < NLM_EPSI_SIZE; n++) {
+		table[n] = Epsi((double)n / NLM_EPSI_STEPS);
+	}
+	return table;
+}
+
+static inline double Epsi_lookup(const double* table, double snr)
+{
+	double x = fabs(snr) * NLM_EPSI_STEPS, t;
+	int n;
+
+	if (!(x < NLM_EPSI_SIZE-1)) {
+		return Epsi(snr);
+	}
+	n = (int)x;
+	t = x - n;
+	return table[n] + t*(table[n+1] - table[n]);
+}
+
+// Function which compute the weighted average for one block, the values
+// being the intensities, or their squares with the rician correction, of a
+// tile buffer with strides px and pxy where the block center (x, y, z) of the
+// sx*sy*sz volume is at offset o
+void Average_block(const nlm_real *values, int o, int x, int y, int z, int neighborhoodsize, double *average, double weight, int sx, int sy, int sz, int px, int pxy)
 {
 	int x_pos, y_pos, z_pos;
 	bool is_outside; 
-	int a, b, c, ns, sxy, count;
+	int a, b, c, ns, count;
 
 	ns = 2*neighborhoodsize+1;
-	sxy = sx*sy;
 
 	count = 0;
 	for (c = 0; c < ns; c++) {
@@ -124,18 +196,10 @@ void Average_block(double *ima, int x, int y, int z, int neighborhoodsize, doubl
 				if ((y_pos < 0) || (y_pos > sy-1)) is_outside = true;
 				if ((x_pos < 0) || (x_pos > sx-1)) is_outside = true;
 
-				if (rician) {
-					if (is_outside) {
-						average[count] = average[count] + ima[z*(sxy)+(y*sx)+x]*ima[z*(sxy)+(y*sx)+x]*weight;
-					} else {
-						average[count] = average[count] + ima[z_pos*(sxy)+(y_pos*sx)+x_pos]*ima[z_pos*(sxy)+(y_pos*sx)+x_pos]*weight;
-					}
+				if (is_outside) {
+					average[count] = average[count] + values[o]*weight;
 				} else {
-					if (is_outside) {
-						average[count] = average[count] + ima[z*(sxy)+(y*sx)+x]*weight;
-					} else {
-						average[count] = average[count] + ima[z_pos*(sxy)+(y_pos*sx)+x_pos]*weight;
-					}
+					average[count] = average[count] + values[o + (c-neighborhoodsize)*pxy + (b-neighborhoodsize)*px + (a-neighborhoodsize)]*weight;
 				}
 				count++;
 			}
@@ -144,18 +208,17 @@ void Average_block(double *ima, int x, int y, int z, int neighborhoodsize, doubl
 }
 
 // Function which computes the value assigned to each voxel
-void Value_block(double *Estimate, double *Label, int x, int y, int z, int neighborhoodsize, double *average, double global_sum, int sx, int sy, int sz)
+void Value_block(double *Estimate, nlm_count *Label, int x, int y, int z, int neighborhoodsize, double *average, double global_sum, int sx, int sy, int sz)
 {
 	int x_pos, y_pos, z_pos;
 	bool is_outside;
 	double value = 0.0;
-	double label = 0.0;
 	double denoised_value = 0.0;
 	int count = 0;
-	int a, b, c, ns, sxy;
+	int a, b, c, ns;
+	ptrdiff_t q;
 
 	ns = 2*neighborhoodsize + 1;
-	sxy = sx*sy;
 
 	for (c = 0; c < ns; c++) {
 		for (b = 0; b < ns; b++) {
@@ -169,12 +232,12 @@ void Value_block(double *Estimate, double *Label, int x, int y, int z, int neigh
 				if ((y_pos < 0) || (y_pos > sy-1)) is_outside = true;
 				if ((x_pos < 0) || (x_pos > sx-1)) is_outside = true;
 				if (!is_outside) {		
-					value = Estimate[z_pos*(sxy)+(y_pos*sx)+x_pos];
+					q = ((ptrdiff_t)z_pos*sy + y_pos)*sx + x_pos;
+					value = Estimate[q];
 					value = value + (average[count]/global_sum);
 
-					label = Label[(x_pos + y_pos*sx + z_pos*sxy)];
-					Estimate[z_pos*(sxy)+(y_pos*sx)+x_pos] = value;
-					Label[(x_pos + y_pos*sx + z_pos *sxy)] = label +1;
+					Estimate[q] = value;
+					Label[q]++;
 				}
 				count++;
 			}
@@ -182,334 +245,1768 @@ void Value_block(double *Estimate, double *Label, int x, int y, int z, int neigh
 	}
 }
 
-double distance(double* ima, int x, int y, int z, int nx, int ny, int nz, int f, int sx, int sy, int sz)
+// Function which compute the weighted average for one block whose patch
+// (centered at offset o of the tile buffer, see Average_block) lies inside
+// the volume, F is the patch radius when known at compile time and 0 otherwise
+template <int F>
+static inline void Average_block_interior(const nlm_real *values, int o, int f, double *average, double weight, int sx, int sxy)
 {
-	double d, acu, distancetotal;
-	int i, j, k, ni1, nj1, ni2, nj2, nk1, nk2;
+	int a, b, c, count;
+	const nlm_real *p;
 
-	distancetotal = 0;
-	for (k = -f; k <= f; k++) {
-		nk1 = z+k;
-		nk2 = nz+k;  
-		if (nk1 < 0) nk1=-nk1;
-		if (nk2 < 0) nk2=-nk2;
-		if (nk1 >= sz) nk1=2*sz-nk1-1;    
-		if (nk2 >= sz) nk2=2*sz-nk2-1;
-		for (j = -f; j <= f; j++) {
-			nj1 = y+j;
-			nj2 = ny+j;    
-			if (nj1 < 0) nj1=-nj1;    
-			if (nj2 < 0) nj2=-nj2;
-			if (nj1 >= sy) nj1=2*sy-nj1-1;
-			if (nj2 >= sy) nj2=2*sy-nj2-1;
-			for (i = -f; i <= f; i++) {
-				ni1 = x+i;
-				ni2 = nx+i;    
-				if (ni1 < 0) ni1=-ni1;
-				if (ni2 < 0) ni2=-ni2;    
-				if (ni1 >= sx) ni1=2*sx-ni1-1;
-				if (ni2 >= sx) ni2=2*sx-ni2-1;
+	if (F) f = F;
+	const int ns = 2*f+1;
 
-				distancetotal = distancetotal + ((ima[nk1*(sx*sy)+(nj1*sx)+ni1] - ima[nk2*(sx*sy)+(nj2*sx)+ni2]) * 
-												 (ima[nk1*(sx*sy)+(nj1*sx)+ni1] - ima[nk2*(sx*sy)+(nj2*sx)+ni2]));   
+	count = 0;
+	for (c = 0; c < ns; c++) {
+		for (b = 0; b < ns; b++) {
+			p = values + o + (c-f)*sxy + (b-f)*sx - f;
+			for (a = 0; a < ns; a++) {
+				average[count] = average[count] + p[a]*weight;
+				count++;
 			}
 		}
 	}
-
-	acu = (2*f+1)*(2*f+1)*(2*f+1);
-	d = distancetotal/acu;
-
-	return d;
 }
 
-double distance2(double* ima,double * medias, int x, int y, int z, int nx, int ny, int nz, int f, int sx, int sy, int sz)
+// Function which computes the value assigned to each voxel of a block whose
+// patch (centered at offset o) lies inside the volume
+template <int F>
+static inline void Value_block_interior(double *Estimate, nlm_count *Label, ptrdiff_t o, int f, double *average, double global_sum, int sx, int sxy)
 {
-	double d, acu, distancetotal;
-	int i, j, k, ni1, nj1, ni2, nj2, nk1, nk2;
+	int a, b, c, count;
+	double *e;
+	nlm_count *l;
 
-	acu = 0;
-	distancetotal = 0;
-	for (k = -f; k <= f; k++) {
-		nk1 = z+k;
-		nk2 = nz+k;
-		if (nk1 < 0) nk1 = -nk1;
-		if (nk2 < 0) nk2 = -nk2;
-		if (nk1 >= sz) nk1 = 2*sz-nk1-1;
-		if (nk2 >= sz) nk2 = 2*sz-nk2-1;
-		for (j = -f; j <= f; j++) {
-			nj1 = y+j;
-			nj2 = ny+j;
-			if (nj1 < 0) nj1 = -nj1;
-			if (nj2 < 0) nj2 = -nj2;
-			if (nj1 >= sy) nj1 = 2*sy-nj1-1;
-			if (nj2 >= sy) nj2 = 2*sy-nj2-1;
-			for (i = -f; i <= f; i++) {
-				ni1 = x+i;
-				ni2 = nx+i;
-				if (ni1 < 0) ni1 = -ni1;
-				if (ni2 < 0) ni2 = -ni2;
-				if (ni1 >= sx) ni1 = 2*sx-ni1-1;
-				if (ni2 >= sx) ni2 = 2*sx-ni2-1;
+	if (F) f = F;
+	const int ns = 2*f+1;
 
-				d = (ima[nk1*(sx*sy)+(nj1*sx)+ni1] - medias[nk1*(sx*sy)+(nj1*sx)+ni1]) - 
-					(ima[nk2*(sx*sy)+(nj2*sx)+ni2] - medias[nk2*(sx*sy)+(nj2*sx)+ni2]);            
-				distancetotal = distancetotal + d*d;
+	count = 0;
+	for (c = 0; c < ns; c++) {
+		for (b = 0; b < ns; b++) {
+			e = Estimate + o + (c-f)*sxy + (b-f)*sx - f;
+			l = Label + o + (c-f)*sxy + (b-f)*sx - f;
+			for (a = 0; a < ns; a++) {
+				e[a] = e[a] + (average[count]/global_sum);
+				l[a]++;
+				count++;
 			}
 		}
 	}
-
-	acu = (2*f+1)*(2*f+1)*(2*f+1);
-	d = distancetotal/acu;
-
-	return d;
 }
 
-void Regularize(double* in, double * out, int r, int sx, int sy, int sz)
+// Reflects the coordinate n into [0, s) the same way the patch distances do
+static inline int Mirror(int n, int s)
 {
-	double acu;
-	int ind, i, j, k, ni, nj, nk, ii, jj, kk;
+	if (n < 0) n = -n;
+	if (n >= s) n = 2*s-n-1;
+	return MAX(0, MIN(s-1, n));
+}
 
-	double* temp = (double*)calloc(sx*sy*sz, sizeof(double));
+// Copies the (2f+1)^3 patch starting at offset o into contiguous rows
+void Pack_patch(nlm_real* ima, int o, int f, int sx, int sxy, nlm_real* patch)
+{
+	int b, c, n;
 
-	// separable convolution
-	for (k = 0; k < sz; k++)
-	for (j = 0; j < sy; j++)
-	for (i = 0; i < sx; i++)
-	{
-		if (in[k*(sx*sy)+(j*sx)+i] == 0) {
-			continue;
+	n = 2*f+1;
+	for (c = 0; c < n; c++) {
+		for (b = 0; b < n; b++) {
+			memcpy(patch, ima + o + c*sxy + b*sx, n*sizeof(nlm_real));
+			patch += n;
 		}
+	}
+}
 
-		acu = 0;
-		ind = 0;
-		for (ii = -r; ii <= r; ii++) {
-			ni = i+ii;
-			if (ni < 0) ni = -ni;
-			if (ni >= sx) ni = 2*sx-ni-1;
-			if (in[k*(sx*sy)+(j*sx)+ni] > 0) {
-				acu+=in[k*(sx*sy)+(j*sx)+ni];
-				ind++;		
+// Same as Pack_patch for the mean subtracted intensities ima-means
+void Pack_patch2(nlm_real* ima, nlm_real* means, int o, int f, int sx, int sxy, nlm_real* patch)
+{
+	int a, b, c, n, q;
+
+	n = 2*f+1;
+	for (c = 0; c < n; c++) {
+		for (b = 0; b < n; b++) {
+			q = o + c*sxy + b*sx;
+			for (a = 0; a < n; a++) {
+				*patch++ = ima[q+a] - means[q+a];
 			}
 		}
-		if (ind == 0) ind = 1;
-		out[k*(sx*sy)+(j*sx)+i] = acu/ind;
 	}
-	for (k = 0; k < sz; k++)
-	for (j = 0; j < sy; j++)
-	for (i = 0; i < sx; i++)
-	{
-		if (out[k*(sx*sy)+(j*sx)+i] == 0) {
-			continue;
+}
+
+typedef struct {
+	const nlm_real* in;
+	nlm_real* out;
+	int r, sx, sy, sz;
+	voxelbox box;
+	// the pass along z writes the slices [z0, z1) to dst
+	nlm_real* dst;
+	int z0, z1;
+} regargument;
+
+// Adds the sign times the positive values of the w values x to the sums and
+// their number to the counts
+static inline void Add_positive(const nlm_real* x, int w, double sign, double* sum, double* cnt)
+{
+	int i;
+
+	for (i = 0; i < w; i++) {
+		if (x[i] > 0) {
+			sum[i] += sign*x[i];
+			cnt[i] += sign;
 		}
+	}
+}
 
-		acu = 0;
-		ind = 0;
-		for (jj = -r; jj <= r; jj++) {	
-			nj = j+jj;
-			if (nj < 0) nj = -nj;		
-			if (nj >= sy) nj = 2*sy-nj-1;
+// Averages the positive values within r of each element [l0, l1) of w lines
+// of n values, src[l*ss + i] being the element l of the line i, mirrored at
+// both ends, with running sums: dst[l*ds + i] is set to the average, or to 0
+// if there is no positive value, where src[l*ss + i] is nonzero. sum and cnt
+// hold w doubles.
+static void Masked_average(const nlm_real* src, ptrdiff_t ss, nlm_real* dst, ptrdiff_t ds, int w, int n, int l0, int l1, int r, double* sum, double* cnt)
+{
+	const nlm_real* x;
+	int i, l;
 
-			if (out[k*(sx*sy)+(nj*sx)+i] > 0) {
-				acu += out[k*(sx*sy)+(nj*sx)+i];            
-				ind++;		
+	memset(sum, 0, w * sizeof(double));
+	memset(cnt, 0, w * sizeof(double));
+	for (l = l0-r; l <= l0+r; l++) {
+		Add_positive(src + Mirror(l, n)*ss, w, 1, sum, cnt);
+	}
+	for (l = l0; l < l1; l++) {
+		if (l > l0) {
+			Add_positive(src + Mirror(l-r-1, n)*ss, w, -1, sum, cnt);
+			Add_positive(src + Mirror(l+r, n)*ss, w, 1, sum, cnt);
+		}
+		x = src + l*ss;
+		for (i = 0; i < w; i++) {
+			if (x[i] != 0) {
+				// the counts are exact, the sums may keep a rounding residue
+				dst[l*ds + i] = cnt[i] > 0 ? sum[i] / cnt[i] : 0;
 			}
 		}
-		if (ind == 0) {
-			ind = 1;
+	}
+}
+
+// The passes of Regularize: along x from in to out over the slices [k0, k1),
+// then along y over the slices in place and along z over the rows [j0, j1)
+// from out to dst, each pass reading a copy of the lines it may overwrite
+static void Regularize_x(void* p, int k0, int k1)
+{
+	regargument* arg = (regargument*)p;
+	int sx = arg->sx, sy = arg->sy;
+	double sum, cnt;
+	int j, k;
+
+	for (k = MAX(k0, arg->box.z0); k < MIN(k1, arg->box.z1); k++)
+	for (j = arg->box.y0; j < arg->box.y1; j++) {
+		Masked_average(arg->in + ((ptrdiff_t)k*sy + j)*sx, 1, arg->out + ((ptrdiff_t)k*sy + j)*sx, 1, 1, sx, arg->box.x0, arg->box.x1, arg->r, &sum, &cnt);
+	}
+}
+
+static void Regularize_y(void* p, int k0, int k1)
+{
+	regargument* arg = (regargument*)p;
+	int sx = arg->sx, sy = arg->sy, x0 = arg->box.x0, w = arg->box.x1 - x0;
+	nlm_real *out, *lines;
+	double* sums;
+	int j, k;
+
+	lines = (nlm_real*)malloc(sy*w * sizeof(nlm_real));
+	sums = (double*)malloc(2*w * sizeof(double));
+	for (k = MAX(k0, arg->box.z0); k < MIN(k1, arg->box.z1); k++) {
+		out = arg->out + (ptrdiff_t)k*sx*sy + x0;
+		for (j = 0; j < sy; j++) {
+			memcpy(lines + j*w, out + j*sx, w * sizeof(nlm_real));
 		}
-		temp[k*(sx*sy)+(j*sx)+i] = acu/ind;
+		Masked_average(lines, w, out, sx, w, sy, arg->box.y0, arg->box.y1, arg->r, sums, sums + w);
 	}
-	for (k = 0; k < sz; k++)
-	for (j = 0; j < sy; j++)
-	for (i = 0; i < sx; i++)
-	{
-		if (temp[k*(sx*sy)+(j*sx)+i] == 0) {
-			continue;
+	free(lines);
+	free(sums);
+}
+
+static void Regularize_z(void* p, int j0, int j1)
+{
+	regargument* arg = (regargument*)p;
+	int sx = arg->sx, sy = arg->sy, sz = arg->sz, x0 = arg->box.x0, w = arg->box.x1 - x0;
+	// the slices within r of [z0, z1), mirrored
+	int c0 = MAX(0, arg->z0 - arg->r), c1 = MIN(sz, arg->z1 + arg->r);
+	int l0 = MAX(arg->z0, arg->box.z0), l1 = MIN(arg->z1, arg->box.z1);
+	nlm_real *out, *lines;
+	double* sums;
+	int j, k;
+
+	if (l0 >= l1) {
+		return;
+	}
+	lines = (nlm_real*)malloc((c1-c0)*w * sizeof(nlm_real));
+	sums = (double*)malloc(2*w * sizeof(double));
+	for (j = MAX(j0, arg->box.y0); j < MIN(j1, arg->box.y1); j++) {
+		out = arg->out + j*sx + x0;
+		for (k = c0; k < c1; k++) {
+			memcpy(lines + (k-c0)*w, out + (ptrdiff_t)k*sx*sy, w * sizeof(nlm_real));
 		}
+		Masked_average(lines - c0*w, w, arg->dst + j*sx + x0, (ptrdiff_t)sx*sy, w, sz, l0, l1, arg->r, sums, sums + w);
+	}
+	free(lines);
+	free(sums);
+}
 
-		acu = 0;
-		ind = 0;
-		for (kk = -r; kk <= r; kk++) {
-			nk = k+kk;
-			if (nk < 0) nk = -nk;			
-			if (nk >= sz) nk = 2*sz-nk-1;		
-			if (temp[nk*(sx*sy)+(j*sx)+i] > 0) {
-				acu += temp[nk*(sx*sy)+(j*sx)+i];
-				ind++;
-			}
+// Smooths the positive values of in with a box of radius r along x, y and z
+// in turn, each pass averaging the positive values of the box around the
+// nonzero voxels only, at the same cost for any r thanks to running sums. Only
+// the voxels of box are written to out, in and out being 0 outside of it; out
+// keeps its values where the passes leave a voxel out, all of them being
+// nonnegative.
+void Regularize(NLMPool* pool, const nlm_real* in, nlm_real* out, int r, int sx, int sy, int sz, const voxelbox* box)
+{
+	regargument arg = { in, out, r, sx, sy, sz, *box, out, 0, sz };
+
+	if (box->x0 >= box->x1) {
+		return;
+	}
+	// separable convolution, parallel over the slices along x and y and over
+	// the rows along z
+	Pool_for(pool, sz, Regularize_x, &arg);
+	Pool_for(pool, sz, Regularize_y, &arg);
+	Pool_for(pool, sy, Regularize_z, &arg);
+}
+
+// preselection of the candidates from the local means and variances
+#define NLM_EPSILON 0.00001
+#define NLM_MU1     0.95
+#define NLM_VAR1    0.5
+// the ratio tests x/y in (c, 1/c) of the preselection are |log(x)-log(y)| <
+// -log(c) on the logarithms of the means, of max_val minus the means and of
+// the variances, see Tile_buffer_fill
+#define NLM_LOG_MU1  0.051293294387550533	// -log(NLM_MU1)
+#define NLM_LOG_VAR1 0.69314718055994531	// -log(NLM_VAR1)
+
+// Returns nonzero if the voxel at offset p of the volumes can be filtered
+static inline int Eligible(const nlm_real* ima, const nlm_real* means, const nlm_real* vars, ptrdiff_t p)
+{
+	return (ima[p] > 0) & (means[p] > NLM_EPSILON) & (vars[p] > NLM_EPSILON);
+}
+
+// Returns the bits of the voxels q..q+n-1 (n <= 64) of the eligible mask of a
+// tile buffer, voxel q being bit q%64 of word q/64
+static inline unsigned long long Mask_bits(const unsigned long long* mask, int q, int n)
+{
+	int w = q >> 6, s = q & 63;
+	unsigned long long bits = mask[w] >> s;
+
+	if (s + n > 64) {
+		bits |= mask[w+1] << (64-s);
+	}
+	return (n < 64) ? bits & ((1ULL << n) - 1) : bits;
+}
+
+// Returns nonzero if the voxel q is set in the eligible mask of a tile buffer
+static inline int Mask_bit(const unsigned long long* mask, int q)
+{
+	return (int)(mask[q >> 6] >> (q & 63)) & 1;
+}
+
+// Sets mask[n] to Eligible(q0+n) for the n0 voxels of the search window row
+// starting at q0, emask being the eligible mask, and whose local statistics
+// are close to those of p, from the logarithms lm, lmi and lv of a tile buffer.
+// Runs of 64 voxels with no eligible one are cleared without being tested.
+static inline void Preselect_row(const unsigned long long* emask, const nlm_real* lm, const nlm_real* lmi, const nlm_real* lv, int p, int q0, int n0, unsigned char* mask)
+{
+	const double m = lm[p], mi = lmi[p], va = lv[p];
+	unsigned long long bits;
+	int n, n1, l;
+
+	lm += q0; lmi += q0; lv += q0;
+	for (n1 = 0; n1 < n0; n1 += 64) {
+		l = MIN(64, n0-n1);
+		bits = Mask_bits(emask, q0+n1, l);
+		if (bits == 0) {
+			memset(mask+n1, 0, l);
+			continue;
 		}
-		if (ind == 0) {
-			ind = 1;
+		for (n = n1; n < n1+l; n++) {
+			mask[n] = (unsigned char)(bits >> (n-n1)) & 1 &
+			          ((fabs(m-lm[n]) < NLM_LOG_MU1) | ((fabs(mi-lmi[n]) < NLM_LOG_MU1) & (fabs(va-lv[n]) < NLM_LOG_VAR1)));
 		}
-		out[k*(sx*sy)+(j*sx)+i] = acu/ind;
 	}
+}
 
-	free(temp);
+// Working set of one tile: the voxels read by its blocks, the tile centers plus
+// a halo of v+f, mirrored at the borders of the volume, in contiguous buffers
+// of sx*sy*sz voxels so that the search and distance loops of the tile stay in
+// the cache and need no boundary checks
+typedef struct {
+	nlm_real *ima, *means, *lm, *lmi, *lv;
+	// squares of ima averaged by the blocks with the rician correction, NULL
+	// without it
+	nlm_real *squares;
+	// Eligible() of the voxels, voxel q is bit q%64 of word q/64, with one spare
+	// word for Mask_bits
+	unsigned long long *eligible;
+	int sx, sy, sz;
+} tilebuffer;
+
+// Allocates the buffers of tiles of up to nv voxels, with the squares when
+// rician
+static void Tile_buffer_alloc(tilebuffer* tb, size_t nv, bool rician)
+{
+	tb->squares = rician ? (nlm_real*)malloc(nv * sizeof(nlm_real)) : NULL;
+	tb->ima   = (nlm_real*)malloc(nv * sizeof(nlm_real));
+	tb->means = (nlm_real*)malloc(nv * sizeof(nlm_real));
+	tb->lm    = (nlm_real*)malloc(nv * sizeof(nlm_real));
+	tb->lmi   = (nlm_real*)malloc(nv * sizeof(nlm_real));
+	tb->lv    = (nlm_real*)malloc(nv * sizeof(nlm_real));
+	tb->eligible = (unsigned long long*)malloc((nv/64 + 2) * sizeof(unsigned long long));
 }
 
-#ifdef _WIN32
-unsigned __stdcall ThreadFunc(void* pArguments)
-#else
-void* ThreadFunc(void* pArguments)
-#endif
+static void Tile_buffer_free(tilebuffer* tb)
 {
-	double *bias, *Estimate, *Label, *ima, *means, *variances, *average, epsilon, mu1, var1, totalweight, wmax, t1, t1i, t2, d, w, distanciaminima;
-	int rows, cols, slices, ini, fin, v, f, init, i, j, k, rc, ii, jj, kk, ni, nj, nk, Ndims;
-	bool rician;
-	double max_val;
+	free(tb->ima);
+	free(tb->means);
+	free(tb->lm);
+	free(tb->lmi);
+	free(tb->lv);
+	free(tb->squares);
+	free(tb->eligible);
+}
 
-	myargument arg;
-	arg = *(myargument*)pArguments;
-
-	rows = arg.rows;
-	cols = arg.cols;
-	slices = arg.slices;
-	ini = arg.ini;
-	fin = arg.fin;
-	ima = arg.in_image;
-	means = arg.means_image;
-	variances = arg.var_image;
-	Estimate = arg.estimate;
-	bias = arg.bias;
-	Label = arg.label;
-	v = arg.radioB;
-	f = arg.radioS;
-	rician = arg.rician;
-	max_val = arg.max_val;
+// Fills the buffers with the sx*sy*sz voxels of the volumes of arg from (x0,
+// y0, z0) on, mirrored outside of them. The logarithms of the means, of
+// max_val minus the means and of the variances take the place of three
+// divisions per pair in Preselect_row, they are only computed for the eligible
+// voxels, the only ones compared, and 0 for the others. Without any block to
+// filter in the tile, only the values averaged by the blocks are filled, no
+// voxel being eligible.
+static void Tile_buffer_fill(tilebuffer* tb, const myargument* arg, int x0, int y0, int z0, int sx, int sy, int sz, bool filtered)
+{
+	const nlm_real *ima, *means, *vars;
+	ptrdiff_t o;
+	int x, y, z, q, l;
+
+	tb->sx = sx;
+	tb->sy = sy;
+	tb->sz = sz;
+	memset(tb->eligible, 0, ((sx*sy*sz)/64 + 2) * sizeof(unsigned long long));
+	for (z = 0; z < sz; z++)
+	for (y = 0; y < sy; y++) {
+		o = ((ptrdiff_t)Mirror(z0+z, arg->slices)*arg->rows + Mirror(y0+y, arg->rows))*arg->cols;
+		ima = arg->in_image + o;
+		means = arg->means_image + o;
+		vars = arg->var_image + o;
+		l = (z*sy + y)*sx;
+		for (x = 0; x < sx; x++, l++) {
+			q = Mirror(x0+x, arg->cols);
+			tb->ima[l] = ima[q];
+			if (tb->squares) {
+				tb->squares[l] = ima[q]*ima[q];
+			}
+			if (!filtered) {
+				continue;
+			}
+			tb->means[l] = means[q];
+			if (Eligible(ima, means, vars, q)) {
+				tb->lm[l]  = (nlm_real)log((double)means[q]);
+				tb->lmi[l] = (nlm_real)log(arg->max_val - means[q]);
+				tb->lv[l]  = (nlm_real)log((double)vars[q]);
+				tb->eligible[l >> 6] |= 1ULL << (l & 63);
+			} else {
+				tb->lm[l] = tb->lmi[l] = tb->lv[l] = 0;
+			}
+		}
+	}
+}
+
+// Returns true if any block of the tile [bi0, bi1) x [bj0, bj1) x [bk0, bk1),
+// s being the block stride, is filtered, the block centers being Eligible in
+// the volumes of arg
+static bool Tile_filtered(const myargument* arg, int s, int bi0, int bi1, int bj0, int bj1, int bk0, int bk1)
+{
+	ptrdiff_t p;
+	int bi, bj, bk;
+
+	for (bk = bk0; bk < bk1; bk++)
+	for (bj = bj0; bj < bj1; bj++)
+	for (bi = bi0; bi < bi1; bi++) {
+		p = ((ptrdiff_t)s*bk*arg->rows + s*bj)*arg->cols + s*bi;
+		if (Eligible(arg->in_image, arg->means_image, arg->var_image, p)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Block loop of one thread. F and V are the patch and search radii the loop is
+// specialized for, 0 stands for the runtime value of arg->radioS/arg->radioB.
+template <int F, int V>
+static void Filter_blocks(const myargument* arg)
+{
+	double *Estimate, *average, totalweight, wmax, w, distanciaminima;
+	nlm_real *pima, *pmeans, *plm, *plmi, *plv, *pvalues;
+	nlm_count *Label;
+	nlm_real *cpatch, *cpatch2;
+	double *cdist, *cweight;
+	int rows, cols, slices, init, i, j, k, rc, ii, jj, kk, Ndims, Nsearch, ncand, m;
+	int t, bi0, bi1, bj0, bj1, bk0, bk1;
+	int pad, px, pxy, p, q, fo, k0, k1, j0, j1, i0, i1, ib, jb, kb, n;
+	int *cand, *cand_off;
+	unsigned char *mask;
+	const unsigned long long *emask;
+	bool rician, interior;
+	const NLMKernels* kernels;
+	tilebuffer tb;
+	// raster index of the block and offset of its center in the volume
+	ptrdiff_t b, o;
+
+	const int v = V ? V : arg->radioB;
+	const int f = F ? F : arg->radioS;
+
+	rows = arg->rows;
+	cols = arg->cols;
+	slices = arg->slices;
+	pad = arg->pad;
+	Estimate = arg->estimate;
+	Label = arg->label;
+	rician = arg->rician;
+	kernels = arg->kernels;
+	const int T = arg->tile;
+	const int s = arg->stride;
 
 	// filter
-	epsilon = 0.00001;
-	mu1 = 0.95;
-	var1 = 0.5;
 	init = 0;
 	rc = rows*cols;
+	// tiles of up to n voxels along each axis, within the halo of f of the
+	// volume read by the patches
+	n = s*(T-1)+1 + 2*pad;
+	Tile_buffer_alloc(&tb, (size_t)MIN(n, cols+2*f)*MIN(n, rows+2*f)*MIN(n, slices+2*f), rician);
 
 	Ndims = (2*f+1)*(2*f+1)*(2*f+1);
+	Nsearch = (2*v+1)*(2*v+1)*(2*v+1);
 
 	average = (double*)malloc(Ndims*sizeof(double));
+	// packed center patch and preselected candidates of the current block
+	cpatch = (nlm_real*)malloc(Ndims*sizeof(nlm_real));
+	cpatch2 = (nlm_real*)malloc(Ndims*sizeof(nlm_real));
+	cdist = (double*)malloc(Nsearch*sizeof(double));
+	cweight = (double*)malloc(Nsearch*sizeof(double));
+	cand = (int*)malloc(3*Nsearch*sizeof(int));
+	cand_off = (int*)malloc(Nsearch*sizeof(int));
+	mask = (unsigned char*)malloc(2*v+1);
+
+	while ((t = Scheduler_next(arg->sched, arg->worker)) >= 0) {
+		// blocks [bi0, bi1) x [bj0, bj1) x [bk0, bk1) of the tile
+		bi0 = T*(t % arg->ntx);
+		bj0 = T*((t / arg->ntx) % arg->nty);
+		bk0 = T*(t / (arg->ntx*arg->nty));
+		bi1 = MIN(arg->nbx, bi0+T);
+		bj1 = MIN(arg->nby, bj0+T);
+		bk1 = MIN(arg->nbz, bk0+T);
+		// the maximum weight is carried from block to block within the tile.
+		// Resetting it per tile, where the original code carried it over the
+		// whole slab of a thread, changes the weight of the center block but
+		// makes the output independent of the thread count and schedule.
+		wmax = 0.0;
+
+		// the voxels of the tile from (ib, jb, kb) on, pad being v+f, pvalues
+		// being the intensities averaged by the blocks
+		ib = MAX(s*bi0 - pad, -f);
+		jb = MAX(s*bj0 - pad, -f);
+		kb = MAX(s*bk0 - pad, -f);
+		Tile_buffer_fill(&tb, arg, ib, jb, kb,
+			MIN(s*(bi1-1) + pad, cols-1 + f) + 1 - ib, MIN(s*(bj1-1) + pad, rows-1 + f) + 1 - jb, MIN(s*(bk1-1) + pad, slices-1 + f) + 1 - kb,
+			Tile_filtered(arg, s, bi0, bi1, bj0, bj1, bk0, bk1));
+		pima = tb.ima;
+		pmeans = tb.means;
+		plm = tb.lm;
+		plmi = tb.lmi;
+		plv = tb.lv;
+		emask = tb.eligible;
+		pvalues = rician ? tb.squares : pima;
+		px = tb.sx;
+		pxy = tb.sx*tb.sy;
+		// offset from the center to the first voxel of a patch
+		fo = f*pxy + f*px + f;
+
+		for (k = s*bk0; k < s*bk1; k += s)
+		for (j = s*bj0; j < s*bj1; j += s)
+		for (i = s*bi0; i < s*bi1; i += s)
+		{ 
+			// init  
+			for (init = 0; init < Ndims; init++) {
+				average[init] = 0.0;
+			}
+			totalweight = 0.0;
+			distanciaminima = 100000000000000;
+			// raster index of the block. The maximum weight becomes 1 at the
+			// first block which is not filtered and stays 1 for all later ones.
+			b = ((ptrdiff_t)(k/s)*arg->nby + j/s)*arg->nbx + i/s;
+			if (arg->state[b] == NLM_BLOCK_NONE) {
+				continue;
+			}
+			if (b > arg->first_skipped) {
+				wmax = 1.0;
+			}
+			if (arg->state[b] == NLM_BLOCK_BACKGROUND) {
+				// which would not be filtered either
+				wmax = 1.0;
+				continue;
+			}
 
-	wmax = 0.0;
-
-	for (k = ini; k < fin; k += 2)
-	for (j = 0; j < rows; j += 2)
-	for (i = 0; i < cols; i += 2)
-	{ 
-		// init  
-		for (init = 0; init < Ndims; init++) {
-			average[init] = 0.0;
-		}
-		totalweight = 0.0;
-		distanciaminima = 100000000000000;
-
-		if (ima[k*rc+(j*cols)+i] > 0 && (means[k*rc+(j*cols)+i]) > epsilon && (variances[k*rc+(j*cols)+i] > epsilon)) {
-			// calculate minimum distance
-			for (kk = -v; kk <= v; kk++) {
-				nk = k+kk;
-				for (jj = -v; jj <= v; jj++) {
-					nj = j+jj;
-					for (ii = -v; ii <= v; ii++) {
-						ni = i+ii;														
-						if (ii == 0 && jj == 0 && kk == 0) {
-							continue;
+			// offset of the block center in the tile buffers
+			p = (k-kb)*pxy + (j-jb)*px + (i-ib);
+			// the search window clipped to the volume
+			k0 = MAX(-v, -k); k1 = MIN(v, slices-1-k);
+			j0 = MAX(-v, -j); j1 = MIN(v, rows-1-j);
+			i0 = MAX(-v, -i); i1 = MIN(v, cols-1-i);
+			// the patches of all the candidates of an interior block lie inside the
+			// volume, only border blocks need the checks of Average_block/Value_block
+			interior = (i-v-f >= 0 && j-v-f >= 0 && k-v-f >= 0 && i+v+f < cols && j+v+f < rows && k+v+f < slices);
+
+			if (Mask_bit(emask, p)) {
+				// preselect the candidates of the search window once, both sweeps
+				// below read the candidates and their distances from these buffers
+				ncand = 0;
+				for (kk = k0; kk <= k1; kk++) {
+					for (jj = j0; jj <= j1; jj++) {
+						// one row of the search window is tested at once, then its
+						// candidates are appended without branches
+						q = p + kk*pxy + jj*px;
+						Preselect_row(emask, plm, plmi, plv, p, q + i0, i1-i0+1, mask);
+						if (kk == 0 && jj == 0) {
+							mask[-i0] = 0;
 						}
-						if (ni >= 0 && nj >= 0 && nk >= 0 && ni < cols && nj < rows && nk < slices) {
-							if (ima[nk*rc+(nj*cols)+ni] > 0 && (means[nk*(rc)+(nj*cols)+ni]) > epsilon && (variances[nk*rc+(nj*cols)+ni] > epsilon)) {
-								t1  = (means[k*rc+(j*cols)+i])/(means[nk*rc+(nj*cols)+ni]);
-								t1i = (max_val-means[k*(rc)+(j*cols)+i])/(max_val-means[nk*(rc)+(nj*cols)+ni]);
-								t2  = (variances[k*rc+(j*cols)+i])/(variances[nk*rc+(nj*cols)+ni]);
-
-								if ((t1 > mu1 && t1 < (1/mu1)) || (t1i > mu1 && t1i < (1/mu1)) && t2 > var1 && t2 < (1/var1)) {
-									d = distance2(ima, means, i, j, k, ni, nj, nk, f, cols, rows, slices);
-									if (d < distanciaminima) {
-										distanciaminima = d;
-									}
-								}
-							}
+						for (ii = i0; ii <= i1; ii++) {
+							cand[3*ncand  ] = i+ii;
+							cand[3*ncand+1] = j+jj;
+							cand[3*ncand+2] = k+kk;
+							cand_off[ncand] = q + ii - fo;
+							ncand += mask[ii-i0];
 						}
 					}
 				}
-			}
-			if (distanciaminima == 0) {
-				distanciaminima = 1;
-			}
-
-			// rician correction
-			if (rician) {
-				for (kk = -f; kk <= f; kk++) {
-					nk = k+kk;
-					for (ii = -f; ii <= f; ii++) {
-						ni = i+ii;
-						for (jj = -f; jj <= f; jj++) {
-							nj = j+jj;
-							if (ni>=0 && nj>=0 && nk>=0 && ni<cols && nj<rows && nk<slices) {
-								if (distanciaminima == 100000000000000) {
-									bias[nk*(rc)+(nj*cols)+ni] = 0;
-								} else {
-									bias[nk*(rc)+(nj*cols)+ni] = (distanciaminima);
-								}
-							}
+				Pack_patch(pima, p - fo, f, px, pxy, cpatch);
+				Pack_patch2(pima, pmeans, p - fo, f, px, pxy, cpatch2);
+
+				// calculate minimum distance, the candidates left out of it
+				// and of the weights are not summed to the end
+				distanciaminima = kernels->distances(cpatch, cpatch2, pima, pmeans, cand_off, ncand, f, px, pxy, distanciaminima, cdist);
+				if (distanciaminima == 0) {
+					distanciaminima = 1;
+				}
+
+				// rician correction, see Block_bias
+				arg->bdmin[b] = distanciaminima;
+
+				// block filtering, the weights of all the candidates in one pass
+				kernels->weights(cdist, ncand, distanciaminima, cweight);
+				for (m = 0; m < ncand; m++) {
+					w = cweight[m];
+					if (w > wmax) {
+						wmax = w;
+					}
+					if (w > 0) {
+						if (interior) {
+							Average_block_interior<F>(pvalues, cand_off[m] + fo, f, average, w, px, pxy);
+						} else {
+							Average_block(pvalues, cand_off[m] + fo, cand[3*m], cand[3*m+1], cand[3*m+2], f, average, w, cols, rows, slices, px, pxy);
 						}
+						totalweight = totalweight + w;
 					}
 				}
+
+				if (wmax == 0.0) {
+					wmax = 1.0;
+				}
+			} else {
+				wmax = 1.0;
+			}
+			o = ((ptrdiff_t)k*rows + j)*cols + i;
+			if (interior) {
+				Average_block_interior<F>(pvalues, p, f, average, wmax, px, pxy);
+				totalweight = totalweight + wmax;
+				Value_block_interior<F>(Estimate, Label, o, f, average, totalweight, cols, rc);
+			} else {
+				Average_block(pvalues, p, i, j, k, f, average, wmax, cols, rows, slices, px, pxy);
+				totalweight = totalweight + wmax;
+				Value_block(Estimate, Label, i, j, k, f, average, totalweight, cols, rows, slices);
 			}
+		}
+	}
 
-			// block filtering
-			for (kk = -v; kk <= v; kk++) {
-				nk = k+kk;
-				for (jj = -v; jj <= v; jj++) {
-					nj = j+jj;
-					for (ii = -v; ii <= v; ii++) {
-						ni = i+ii;
-						if (ii == 0 && jj == 0 && kk == 0) {
-							continue; 
-						}
-						if (ni>=0 && nj>=0 && nk>=0 && ni<cols && nj<rows && nk<slices) {									
-							if (ima[nk*rc+(nj*cols)+ni] > 0 && (means[nk*(rc)+(nj*cols)+ni]) > epsilon && (variances[nk*rc+(nj*cols)+ni] > epsilon)) {
-								t1  = (means[k*rc+(j*cols)+i])/(means[nk*rc+(nj*cols)+ni]);
-								t1i = (max_val-means[k*(rc)+(j*cols)+i])/(max_val-means[nk*(rc)+(nj*cols)+ni]);
-								t2  = (variances[k*rc+(j*cols)+i])/(variances[nk*rc+(nj*cols)+ni]);
-								if ((t1>mu1 && t1<(1/mu1)) || (t1i>mu1 && t1i<(1/mu1)) && t2>var1 && t2<(1/var1)) {
-									d = distance(ima, i, j, k, ni, nj, nk, f, cols, rows, slices);
-									if (d > 3*distanciaminima) {
-										w = 0;
-									} else {
-										w = exp(-d/distanciaminima);
-									}
-									if (w > wmax) {
-										wmax = w;
-									}
-									if (w > 0) {
-										Average_block(ima, ni, nj, nk, f, average, w, cols, rows, slices, rician);
-										totalweight = totalweight + w;
-									}
-								}
-							}							
-						}
-					}
+	free(average);
+	free(cpatch);
+	free(cpatch2);
+	free(cdist);
+	free(cweight);
+	free(cand);
+	free(cand_off);
+	free(mask);
+	Tile_buffer_free(&tb);
+}
+
+typedef void (*BlockFilterFunc)(const myargument* arg);
+
+// Filter_blocks specialized for the common radii f = 1..3 and v = 2..5
+#define NLM_BLOCKS_MIN_V 2
+#define NLM_BLOCKS_MAX_V 5
+static const BlockFilterFunc s_block_filters[NLM_KERNELS_MAX_F][NLM_BLOCKS_MAX_V-NLM_BLOCKS_MIN_V+1] = {
+	{ Filter_blocks<1, 2>, Filter_blocks<1, 3>, Filter_blocks<1, 4>, Filter_blocks<1, 5> },
+	{ Filter_blocks<2, 2>, Filter_blocks<2, 3>, Filter_blocks<2, 4>, Filter_blocks<2, 5> },
+	{ Filter_blocks<3, 2>, Filter_blocks<3, 3>, Filter_blocks<3, 4>, Filter_blocks<3, 5> },
+};
+
+// Returns the block loop specialized for the radii f and v, or the generic one
+BlockFilterFunc Get_block_filter(int f, int v)
+{
+	if (f >= 1 && f <= NLM_KERNELS_MAX_F && v >= NLM_BLOCKS_MIN_V && v <= NLM_BLOCKS_MAX_V) {
+		return s_block_filters[f-1][v-NLM_BLOCKS_MIN_V];
+	}
+	return Filter_blocks<0, 0>;
+}
+
+// Returns the raster index of the first block (s*bi, s*bj, s*bk) of the block
+// planes [bk0, bk1) of the lattice whose center is not Eligible in the
+// volumes, which is not filtered, or nbx*nby*nbz if there is none. state
+// holds the NLM_BLOCK_* of the blocks.
+ptrdiff_t First_skipped(const nlm_real* ima, const nlm_real* means, const nlm_real* vars, const unsigned char* state, int s, int nbx, int nby, int nbz, int bk0, int bk1, int cols, int rows)
+{
+	ptrdiff_t b;
+	int bi, bj, bk;
+
+	for (bk = bk0; bk < bk1; bk++)
+	for (bj = 0; bj < nby; bj++)
+	for (bi = 0; bi < nbx; bi++) {
+		b = ((ptrdiff_t)bk*nby + bj)*nbx + bi;
+		if (state[b] != NLM_BLOCK_NONE && !Eligible(ima, means, vars, ((ptrdiff_t)s*bk*rows + s*bj)*cols + s*bi)) {
+			return b;
+		}
+	}
+	return (ptrdiff_t)nbx*nby*nbz;
+}
+
+// Writes the slices [z0, z1) of the rician bias from the minimum distances of
+// the blocks of stride s, dmin being -1 for the blocks which are not filtered. The bias of
+// a voxel is the minimum distance of the last filtered block covering it in
+// raster order (0 if that block had no candidate), or 0 for the voxels which
+// are not covered by any filtered block.
+void Block_bias(const double* dmin, int s, int nbx, int nby, int nbz, int f, int cols, int rows, int z0, int z1, nlm_real* bias)
+{
+	int x, y, z, bi, bj, bk;
+	double dm;
+
+	for (z = z0; z < z1; z++)
+	for (y = 0; y < rows; y++)
+	for (x = 0; x < cols; x++) {
+		dm = -1;
+		for (bk = MIN(nbz-1, (z+f)/s); bk >= MAX(0, (z-f+s-1)/s) && dm < 0; bk--)
+		for (bj = MIN(nby-1, (y+f)/s); bj >= MAX(0, (y-f+s-1)/s) && dm < 0; bj--)
+		for (bi = MIN(nbx-1, (x+f)/s); bi >= MAX(0, (x-f+s-1)/s); bi--) {
+			if (dmin[((ptrdiff_t)bk*nby + bj)*nbx + bi] >= 0) {
+				dm = dmin[((ptrdiff_t)bk*nby + bj)*nbx + bi];
+				break;
+			}
+		}
+		bias[((ptrdiff_t)z*rows + y)*cols + x] = (dm < 0 || dm == 100000000000000) ? 0 : dm;
+	}
+}
+
+// edge of the cells of the occupancy grid in voxels
+#define NLM_CELL 4
+
+typedef struct {
+	const nlm_real* ima;
+	int cols, rows, slices, ncx, ncy;
+	unsigned char* grid;
+} occupancyargument;
+
+// Flags the cells of the cell planes [c0, c1) which hold a nonzero voxel
+static void Occupancy_planes(void* p, int c0, int c1)
+{
+	occupancyargument* arg = (occupancyargument*)p;
+	int cols = arg->cols, rows = arg->rows, ncx = arg->ncx, ncy = arg->ncy;
+	int c, x, y, z;
+	const nlm_real* row;
+
+	memset(arg->grid + c0*ncx*ncy, 0, (c1-c0)*ncx*ncy);
+	for (c = c0; c < c1; c++)
+	for (z = c*NLM_CELL; z < MIN(arg->slices, (c+1)*NLM_CELL); z++)
+	for (y = 0; y < rows; y++) {
+		row = arg->ima + ((ptrdiff_t)z*rows + y)*cols;
+		for (x = 0; x < cols; x++) {
+			if (row[x] != 0) {
+				arg->grid[(c*ncy + y/NLM_CELL)*ncx + x/NLM_CELL] = 1;
+			}
+		}
+	}
+}
+
+// Sets box to the bounding box of the flagged cells of an occupancy grid
+// within the volume
+static void Occupied_box(const unsigned char* grid, int cols, int rows, int slices, voxelbox* box)
+{
+	int ncx = (cols + NLM_CELL-1) / NLM_CELL;
+	int ncy = (rows + NLM_CELL-1) / NLM_CELL;
+	int ncz = (slices + NLM_CELL-1) / NLM_CELL;
+	int cx, cy, cz;
+
+	box->x0 = ncx; box->x1 = 0;
+	box->y0 = ncy; box->y1 = 0;
+	box->z0 = ncz; box->z1 = 0;
+	for (cz = 0; cz < ncz; cz++)
+	for (cy = 0; cy < ncy; cy++)
+	for (cx = 0; cx < ncx; cx++) {
+		if (grid[(cz*ncy + cy)*ncx + cx]) {
+			box->x0 = MIN(box->x0, cx); box->x1 = MAX(box->x1, cx+1);
+			box->y0 = MIN(box->y0, cy); box->y1 = MAX(box->y1, cy+1);
+			box->z0 = MIN(box->z0, cz); box->z1 = MAX(box->z1, cz+1);
+		}
+	}
+	if (box->x0 >= box->x1) {
+		box->x0 = box->x1 = box->y0 = box->y1 = box->z0 = box->z1 = 0;
+	} else {
+		box->x0 *= NLM_CELL; box->x1 = MIN(cols, box->x1*NLM_CELL);
+		box->y0 *= NLM_CELL; box->y1 = MIN(rows, box->y1*NLM_CELL);
+		box->z0 *= NLM_CELL; box->z1 = MIN(slices, box->z1*NLM_CELL);
+	}
+}
+
+// Returns the occupancy grid of ima, one flag per cell of NLM_CELL^3 voxels
+// set if the cell holds a nonzero voxel, and sets box to the bounding box of
+// the flagged cells within the volume
+unsigned char* Occupancy_grid(NLMPool* pool, const nlm_real* ima, int cols, int rows, int slices, voxelbox* box)
+{
+	int ncx = (cols + NLM_CELL-1) / NLM_CELL;
+	int ncy = (rows + NLM_CELL-1) / NLM_CELL;
+	int ncz = (slices + NLM_CELL-1) / NLM_CELL;
+	occupancyargument arg = { ima, cols, rows, slices, ncx, ncy, NULL };
+
+	arg.grid = (unsigned char*)MyAlloc(ncx*ncy*ncz);
+	Pool_for(pool, ncz, Occupancy_planes, &arg);
+	Occupied_box(arg.grid, cols, rows, slices, box);
+	return arg.grid;
+}
+
+// Grows a nonempty box by r voxels on each side, within the volume
+void Dilate_box(voxelbox* box, int r, int cols, int rows, int slices)
+{
+	if (box->x0 >= box->x1) {
+		return;
+	}
+	box->x0 = MAX(0, box->x0-r); box->x1 = MIN(cols, box->x1+r);
+	box->y0 = MAX(0, box->y0-r); box->y1 = MIN(rows, box->y1+r);
+	box->z0 = MAX(0, box->z0-r); box->z1 = MIN(slices, box->z1+r);
+}
+
+typedef struct {
+	const unsigned char* grid;
+	int cols, rows, slices, s, nbx, nby, f;
+	unsigned char* state;
+} backgroundargument;
+
+// Marks the background blocks of the block planes [k0, k1)
+static void Background_planes(void* p, int k0, int k1)
+{
+	backgroundargument* arg = (backgroundargument*)p;
+	int ncx = (arg->cols + NLM_CELL-1) / NLM_CELL;
+	int ncy = (arg->rows + NLM_CELL-1) / NLM_CELL;
+	int r = 3*arg->f, s = arg->s, bi, bj, bk, cx, cy, cz;
+	ptrdiff_t n;
+	unsigned char a;
+
+	for (bk = k0; bk < k1; bk++)
+	for (bj = 0; bj < arg->nby; bj++)
+	for (bi = 0; bi < arg->nbx; bi++) {
+		n = ((ptrdiff_t)bk*arg->nby + bj)*arg->nbx + bi;
+		if (arg->state[n] != NLM_BLOCK_ACTIVE) {
+			continue;
+		}
+		a = 0;
+		for (cz = MAX(0, s*bk-r) / NLM_CELL; cz <= MIN(arg->slices-1, s*bk+r) / NLM_CELL && !a; cz++)
+		for (cy = MAX(0, s*bj-r) / NLM_CELL; cy <= MIN(arg->rows-1, s*bj+r) / NLM_CELL && !a; cy++)
+		for (cx = MAX(0, s*bi-r) / NLM_CELL; cx <= MIN(arg->cols-1, s*bi+r) / NLM_CELL && !a; cx++) {
+			a = arg->grid[(cz*ncy + cy)*ncx + cx];
+		}
+		if (!a) {
+			arg->state[n] = NLM_BLOCK_BACKGROUND;
+		}
+	}
+}
+
+// Marks NLM_BLOCK_BACKGROUND the active blocks (s*bi, s*bj, s*bk) whose center
+// is farther than 3f from any nonzero voxel according to the occupancy grid.
+// Such a block is left out of the filtering: every block covering a voxel of
+// its patch then has an all zero patch, is not eligible and adds 0 to the
+// estimate of the voxel, which comes out 0, its input value, whether the
+// block is counted or not.
+void Background_blocks(NLMPool* pool, const unsigned char* grid, int cols, int rows, int slices, int s, int nbx, int nby, int nbz, int f, unsigned char* state)
+{
+	backgroundargument arg = { grid, cols, rows, slices, s, nbx, nby, f, state };
+
+	Pool_for(pool, nbz, Background_planes, &arg);
+}
+
+// The adaptive stride spaces the blocks by the flat stride in the cells of
+// the volume whose mean local variance is at most NLM_FLAT_RATIO times the
+// median over the cells with a nonzero voxel, an estimate of the variance of
+// the noise, and by the base stride elsewhere. The cells span a multiple of
+// both strides and of at least NLM_LATTICE_CELL voxels along each axis.
+#define NLM_FLAT_RATIO   2.0
+#define NLM_LATTICE_CELL 12
+
+typedef struct {
+	const nlm_real *ima, *variances;
+	int cols, rows, slices, cell, ncx, ncy;
+	double* cvar;
+} cellargument;
+
+// Mean local variance of the nonzero voxels of each cell of the cell planes
+// [c0, c1), -1 for the cells without any
+static void Cell_variance_planes(void* p, int c0, int c1)
+{
+	cellargument* arg = (cellargument*)p;
+	int cols = arg->cols, rows = arg->rows, L = arg->cell;
+	int c, cx, cy, x, y, z, n, m;
+	double v;
+
+	for (c = c0; c < c1; c++)
+	for (cy = 0; cy < arg->ncy; cy++)
+	for (cx = 0; cx < arg->ncx; cx++) {
+		v = 0;
+		m = 0;
+		for (z = c*L; z < MIN(arg->slices, (c+1)*L); z++)
+		for (y = cy*L; y < MIN(rows, (cy+1)*L); y++)
+		for (x = cx*L; x < MIN(cols, (cx+1)*L); x++) {
+			n = (z*rows + y)*cols + x;
+			if (arg->ima[n] != 0) {
+				v += arg->variances[n];
+				m++;
+			}
+		}
+		arg->cvar[(c*arg->ncy + cy)*arg->ncx + cx] = m ? v/m : -1;
+	}
+}
+
+static int Compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+// Returns nonzero if u, relative to the origin of a cell of n voxels along an
+// axis, holds blocks of stride m, g being the stride of the block lattice.
+// The centers h, h+m, ..., h being about (m-1)/2, cover the cell with patches
+// of radius f as long as m <= 2f+1, the last voxel of the cell getting a
+// center of its own when the last one is farther than f.
+static inline int Lattice_keep(int u, int n, int m, int g, int f)
+{
+	int h = ((m-1)/2 / g) * g;
+	int last = (n-1 >= h) ? h + ((n-1-h)/m)*m : -f-1;
+
+	if (u >= h && (u-h) % m == 0) {
+		return 1;
+	}
+	return u == ((n-1)/g)*g && n-1-last > f;
+}
+
+typedef struct {
+	const double* cvar;
+	double flat;
+	int cols, rows, slices, cell, ncx, ncy;
+	int g, stride, flat_stride, f, nbx, nby;
+	unsigned char* state;
+} latticeargument;
+
+// States of the blocks of the block planes [k0, k1)
+static void Lattice_planes(void* p, int k0, int k1)
+{
+	latticeargument* arg = (latticeargument*)p;
+	int L = arg->cell, g = arg->g, f = arg->f;
+	int bi, bj, bk, x, y, z, c, m;
+
+	for (bk = k0; bk < k1; bk++)
+	for (bj = 0; bj < arg->nby; bj++)
+	for (bi = 0; bi < arg->nbx; bi++) {
+		x = g*bi;
+		y = g*bj;
+		z = g*bk;
+		c = ((z/L)*arg->ncy + y/L)*arg->ncx + x/L;
+		m = (arg->cvar[c] >= 0 && arg->cvar[c] <= arg->flat) ? arg->flat_stride : arg->stride;
+		arg->state[(bk*arg->nby + bj)*arg->nbx + bi] =
+			(Lattice_keep(x % L, MIN(L, arg->cols - x/L*L), m, g, f) &&
+			 Lattice_keep(y % L, MIN(L, arg->rows - y/L*L), m, g, f) &&
+			 Lattice_keep(z % L, MIN(L, arg->slices - z/L*L), m, g, f)) ? NLM_BLOCK_ACTIVE : NLM_BLOCK_NONE;
+	}
+}
+
+static int Gcd(int a, int b)
+{
+	return b ? Gcd(b, a % b) : a;
+}
+
+// Returns the stride of the block lattice, the gcd of stride and flat_stride,
+// and sets *state to the NLM_BLOCK_ACTIVE/NLM_BLOCK_NONE state of its blocks,
+// of which there are *nbx by *nby by *nbz. All the blocks are active unless
+// flat_stride, the stride of the flat cells, differs from stride.
+int Block_lattice(NLMPool* pool, const nlm_real* ima, const nlm_real* variances, int cols, int rows, int slices, int stride, int flat_stride, int f, int* nbx, int* nby, int* nbz, unsigned char** state)
+{
+	int g = Gcd(stride, flat_stride), l = stride / g * flat_stride;
+	int L = l * ((NLM_LATTICE_CELL + l-1) / l);
+	int ncx = (cols + L-1) / L, ncy = (rows + L-1) / L, ncz = (slices + L-1) / L;
+	int i, nc, nb;
+	double *cvar, *fg;
+
+	*nbx = (cols + g-1) / g;
+	*nby = (rows + g-1) / g;
+	*nbz = (slices + g-1) / g;
+	nb = *nbx * *nby * *nbz;
+	*state = (unsigned char*)MyAlloc(nb);
+	if (flat_stride == stride) {
+		memset(*state, NLM_BLOCK_ACTIVE, nb);
+		return g;
+	}
+
+	cellargument carg = { ima, variances, cols, rows, slices, L, ncx, ncy, NULL };
+	carg.cvar = cvar = (double*)MyAlloc(ncx*ncy*ncz * sizeof(double));
+	Pool_for(pool, ncz, Cell_variance_planes, &carg);
+
+	// the median over the foreground cells
+	fg = (double*)MyAlloc(ncx*ncy*ncz * sizeof(double));
+	nc = 0;
+	for (i = 0; i < ncx*ncy*ncz; i++) {
+		if (cvar[i] >= 0) {
+			fg[nc++] = cvar[i];
+		}
+	}
+	qsort(fg, nc, sizeof(double), Compare_doubles);
+
+	latticeargument larg = { cvar, nc ? NLM_FLAT_RATIO * fg[nc/2] : -1, cols, rows, slices, L, ncx, ncy,
+		g, stride, flat_stride, f, *nbx, *nby, *state };
+	Pool_for(pool, *nbz, Lattice_planes, &larg);
+
+	MyFree(fg);
+	MyFree(cvar);
+	return g;
+}
+
+typedef struct {
+	const double* dmin;
+	int s, nbx, nby, nbz, f, cols, rows;
+	nlm_real* bias;
+} biasargument;
+
+static void Block_bias_slices(void* p, int z0, int z1)
+{
+	biasargument* arg = (biasargument*)p;
+
+	Block_bias(arg->dmin, arg->s, arg->nbx, arg->nby, arg->nbz, arg->f, arg->cols, arg->rows, z0, z1, arg->bias);
+}
+
+void ThreadFunc(void* pArguments)
+{
+	myargument* arg = (myargument*)pArguments;
+
+	arg->filter(arg);
+}
+
+// Filters the tiles of the tile planes [tz0, tz1) flagged in tactive in the 8
+// parity phases, every worker of the pool running ThreadFunc on a copy of arg
+static void Filter_tiles(NLMPool* pool, const myargument* arg, const unsigned char* tactive, int tz0, int tz1)
+{
+	int ntx = arg->ntx, nty = arg->nty, nw = Pool_size(pool);
+	int t0 = tz0*ntx*nty, t1 = tz1*ntx*nty;
+	int i, t, c, ntc, *tiles;
+	myargument *ThreadArgs;
+	NLMScheduler sched;
+
+	ThreadArgs = (myargument*)calloc(nw, sizeof(myargument));
+	tiles = (int*)MyAlloc((t1-t0) * sizeof(int));
+	Scheduler_init(&sched, nw, t1-t0);
+	for (i = 0; i < nw; i++) {
+		ThreadArgs[i] = *arg;
+		ThreadArgs[i].sched = &sched;
+		ThreadArgs[i].worker = i;
+	}
+
+	for (c = 0; c < 8; c++) {
+		// the active tiles whose coordinates have the parities of c
+		ntc = 0;
+		for (t = t0; t < t1; t++) {
+			if (tactive[t] && ((t % ntx) & 1) == (c & 1) && (((t / ntx) % nty) & 1) == ((c >> 1) & 1) && ((t / (ntx*nty)) & 1) == (c >> 2)) {
+				tiles[ntc++] = t;
+			}
+		}
+		if (ntc == 0) {
+			continue;
+		}
+		Scheduler_fill(&sched, tiles, ntc);
+		Pool_run(pool, ThreadFunc, ThreadArgs, sizeof(myargument));
+	}
+
+	Scheduler_free(&sched);
+	MyFree(tiles);
+	free(ThreadArgs);
+}
+
+// Volumes of the stages of main which run slice by slice with Pool_for
+typedef struct {
+	// the input and output, channels floats per voxel: the image, or without
+	// it the slabs of Stream_volume. With input, the mapped input file, the
+	// image only holds the output.
+	FVolume* image;
+	float* voxels;
+	const NIIMapping* input;
+	int channels;
+	int cols, rows, slices;
+	nlm_real *ima, *means, *variances, *bias;
+	nlm_count *label;
+	double *estimate;
+	// maximum intensity of each slice
+	double *slice_max;
+	// radius of the windows of the local means and variances
+	int stats_radius;
+	bool rician;
+	// see Epsi_table
+	const double *epsi;
+	// the voxels which the filtering may change, the others are background
+	// copied through, see main
+	voxelbox box;
+} stageargument;
+
+// Returns the row j of the slice k of the input and output, whose voxels are
+// contiguous, arg->channels floats each
+static inline float* Image_row(const stageargument* arg, int k, int j)
+{
+	if (arg->image != NULL) {
+		return arg->image->m_pData[k][j][0];
+	}
+	return arg->voxels + ((size_t)k*arg->rows + j)*arg->cols*arg->channels;
+}
+
+// Returns the mapped input as the intensities when it holds them as they are,
+// nlm_real being float, which Load_slices then leaves in place, or NULL
+static nlm_real* Mapped_intensities(const NIIMapping* input, int cols, int rows, int channels)
+{
+	if (input == NULL || sizeof(nlm_real) != sizeof(float) || input->datatype != DT_FLOAT32 || channels != 1 ||
+		input->sx != (ptrdiff_t)sizeof(float) || input->sy != (ptrdiff_t)(cols*sizeof(float)) || input->sz != (ptrdiff_t)(cols*rows*sizeof(float)) ||
+		(size_t)input->origin % sizeof(float) != 0) {
+		return NULL;
+	}
+	return (nlm_real*)input->origin;
+}
+
+// Reads the slices [k0, k1) of the input and clears their accumulators, the
+// estimates and the counts of blocks, if any
+static void Load_slices(void* p, int k0, int k1)
+{
+	stageargument* arg = (stageargument*)p;
+	int dims0 = arg->cols, dims1 = arg->rows, ns = arg->channels;
+	int i, j, k;
+	ptrdiff_t n;
+	const float* src;
+	float* row;
+	nlm_real* dst;
+	double max_val;
+
+	if (arg->estimate != NULL) {
+		for (n = (ptrdiff_t)k0*dims0*dims1; n < (ptrdiff_t)k1*dims0*dims1; n++) {
+			arg->estimate[n] = 0.0;
+			arg->label[n] = 0;
+		}
+	}
+
+	// the mapped voxels are converted to float first, as by LoadNIIData
+	row = (arg->input != NULL) ? (float*)malloc(dims0 * sizeof(float)) : NULL;
+	for (k = k0; k < k1; k++) {
+		max_val = 0;
+		for (j = 0; j < dims1; j++) {
+			dst = arg->ima + ((ptrdiff_t)k*dims1 + j)*dims0;
+			if (arg->input == NULL) {
+				src = Image_row(arg, k, j);
+				for (i = 0; i < dims0; i++) {
+					dst[i] = src[i*ns];
+				}
+			} else if ((const void*)arg->ima != arg->input->origin) {
+				// unless ima is the mapping itself, see Mapped_intensities
+				ReadNIIMappedRow(arg->input, j, k, dims0, 1, row);
+				for (i = 0; i < dims0; i++) {
+					dst[i] = row[i];
+				}
+			}
+			for (i = 0; i < dims0; i++) {
+				if (dst[i] > max_val) {
+					max_val = dst[i];
 				}
 			}
+		}
+		arg->slice_max[k] = max_val;
+	}
+	free(row);
+}
 
-			if (wmax == 0.0) {
-				wmax = 1.0;
+// Adds the sign times the n values x to the sums m, and if inside, the sign
+// times x - shift for the nonzero x to the sums s, the sums s2 of their
+// squares and the counts c
+static inline void Add_sums(const nlm_real* x, int n, double sign, bool inside, double shift, double* m, double* s, double* s2, double* c)
+{
+	double d;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		m[i] += sign*x[i];
+	}
+	if (inside) {
+		for (i = 0; i < n; i++) {
+			if (x[i] != 0) {
+				d = x[i] - shift;
+				s[i] += sign*d;
+				s2[i] += sign*d*d;
+				c[i] += sign;
+			}
+		}
+	}
+}
+
+// Mean of the nonzero values among the n values x, 0 if there are none
+static double Nonzero_mean(const nlm_real* x, int n)
+{
+	double s = 0;
+	int i, c = 0;
+
+	for (i = 0; i < n; i++) {
+		if (x[i] != 0) {
+			s += x[i];
+			c++;
+		}
+	}
+	return c ? s/c : 0;
+}
+
+// Adds the sign times the n values x to the sums s
+static inline void Add_row(const double* x, int n, double sign, double* s)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		s[i] += sign*x[i];
+	}
+}
+
+// Computes the local means and variances of the slices [k0, k1) in one pass,
+// over windows of (2R+1)^3 voxels, R being arg->stats_radius. The mean is
+// taken over the window mirrored at the borders of the volume, the variance
+// around that mean over the voxels of the window inside the volume. Both come
+// from sums separable along z, y and x, each kept as a running sum, so a voxel
+// costs the same for any R: the planes of z sums slide from slice to slice,
+// the rows of y sums from row to row, then the x sums along the row. The
+// windows without any nonzero voxel, counted exactly, get a mean and a
+// variance of exactly 0 whatever the rounding of the running sums, as
+// Regularize and the preselection tell them apart from the others. The planes
+// of z sums restart from scratch at every multiple of NLM_STATS_RESTART, so
+// that their rounding does not depend on how the slices are split among the
+// threads or the slabs of --max-memory. The sums of the variance are taken
+// over the nonzero values minus a shift, the mean of the nonzero voxels of the
+// slice of the restart, the zero voxels of the window being added back from
+// their count. The variance of a window without zero voxels is then off by
+// about K*eps*t^2, K being the few hundred additions of the running sums, eps
+// the double epsilon and t the largest |x - shift| met along the sums, instead
+// of K*eps*max(x)^2 without the shift. It is clamped at 0 for the windows where
+// this exceeds it.
+#define NLM_STATS_RESTART 16
+
+static void Statistics_slices(void* p, int k0, int k1)
+{
+	stageargument* arg = (stageargument*)p;
+	const nlm_real* ima = arg->ima;
+	const int R = arg->stats_radius, cols = arg->cols, rows = arg->rows, slices = arg->slices;
+	const int n = rows*cols;
+	const double N = (double)(2*R+1)*(2*R+1)*(2*R+1);
+	double *z, *y, *zm, *zs, *zs2, *zc, *ym, *ys, *ys2, *yc;
+	double sm, ss, ss2, sc, mean, var, shift = 0, nz;
+	int i, j, k, l, cz, cy, cx, u;
+	ptrdiff_t o;
+
+	// plane sums along z and row sums along y: mirrored, inside, squares
+	// inside and nonzero voxels inside
+	z = (double*)malloc(4*n * sizeof(double));
+	zm = z; zs = z + n; zs2 = z + 2*n; zc = z + 3*n;
+	y = (double*)malloc(4*cols * sizeof(double));
+	ym = y; ys = y + cols; ys2 = y + 2*cols; yc = y + 3*cols;
+
+	for (k = k0 - k0 % NLM_STATS_RESTART; k < k1; k++) {
+		if (k % NLM_STATS_RESTART == 0) {
+			memset(z, 0, 4*n * sizeof(double));
+			shift = Nonzero_mean(ima + (ptrdiff_t)k*n, n);
+			for (l = k-R; l <= k+R; l++) {
+				Add_sums(ima + (ptrdiff_t)Mirror(l, slices)*n, n, 1, l >= 0 && l < slices, shift, zm, zs, zs2, zc);
 			}
-			Average_block(ima, i, j, k, f, average, wmax, cols, rows, slices, rician);
-			totalweight = totalweight + wmax;
-			Value_block(Estimate, Label, i, j, k, f, average, totalweight, cols, rows, slices);
 		} else {
-			wmax = 1.0;
-			Average_block(ima, i, j, k, f, average, wmax, cols, rows, slices, rician);
-			totalweight = totalweight + wmax;
-			Value_block(Estimate, Label, i, j, k, f, average, totalweight, cols, rows, slices);
+			Add_sums(ima + (ptrdiff_t)Mirror(k-R-1, slices)*n, n, -1, k-R-1 >= 0, shift, zm, zs, zs2, zc);
+			Add_sums(ima + (ptrdiff_t)Mirror(k+R, slices)*n, n, 1, k+R < slices, shift, zm, zs, zs2, zc);
+		}
+		if (k < k0) {
+			continue;
+		}
+		cz = MIN(slices-1, k+R) - MAX(0, k-R) + 1;
+
+		memset(y, 0, 4*cols * sizeof(double));
+		for (l = -R; l <= R; l++) {
+			Add_row(zm + Mirror(l, rows)*cols, cols, 1, ym);
+		}
+		for (l = 0; l <= MIN(R, rows-1); l++) {
+			Add_row(zs + l*cols, cols, 1, ys);
+			Add_row(zs2 + l*cols, cols, 1, ys2);
+			Add_row(zc + l*cols, cols, 1, yc);
+		}
+		for (j = 0; j < rows; j++) {
+			if (j > 0) {
+				Add_row(zm + Mirror(j-R-1, rows)*cols, cols, -1, ym);
+				Add_row(zm + Mirror(j+R, rows)*cols, cols, 1, ym);
+				for (l = 0; l < 2; l++) {
+					u = l ? j+R : j-R-1;
+					if (u >= 0 && u < rows) {
+						Add_row(zs + u*cols, cols, l ? 1 : -1, ys);
+						Add_row(zs2 + u*cols, cols, l ? 1 : -1, ys2);
+						Add_row(zc + u*cols, cols, l ? 1 : -1, yc);
+					}
+				}
+			}
+			cy = MIN(rows-1, j+R) - MAX(0, j-R) + 1;
+
+			sm = ss = ss2 = sc = 0;
+			for (l = -R; l <= R; l++) {
+				sm += ym[Mirror(l, cols)];
+			}
+			for (l = 0; l <= MIN(R, cols-1); l++) {
+				ss += ys[l];
+				ss2 += ys2[l];
+				sc += yc[l];
+			}
+			o = ((ptrdiff_t)k*rows + j)*cols;
+			for (i = 0; i < cols; i++) {
+				if (i > 0) {
+					sm += ym[Mirror(i+R, cols)] - ym[Mirror(i-R-1, cols)];
+					if (i-R-1 >= 0) {
+						ss -= ys[i-R-1];
+						ss2 -= ys2[i-R-1];
+						sc -= yc[i-R-1];
+					}
+					if (i+R < cols) {
+						ss += ys[i+R];
+						ss2 += ys2[i+R];
+						sc += yc[i+R];
+					}
+				}
+				if (sc == 0) {
+					arg->means[o+i] = 0;
+					arg->variances[o+i] = 0;
+					continue;
+				}
+				cx = MIN(cols-1, i+R) - MAX(0, i-R) + 1;
+				arg->means[o+i] = (nlm_real)(sm / N);
+				// sum of the (x - mean)^2 over the cz*cy*cx voxels inside, nz
+				// of which are zero, shifted by -shift
+				mean = arg->means[o+i] - shift;
+				nz = cz*cy*cx - sc;
+				var = (ss2 + nz*shift*shift - 2*mean*(ss - nz*shift) + cz*cy*cx*mean*mean) / (cz*cy*cx - 1);
+				arg->variances[o+i] = (nlm_real)MAX(0.0, var);
+			}
 		}
 	}
 
-#ifdef _WIN32
-	_endthreadex(0);
+	free(z);
+	free(y);
+}
+
+// Aggregation of the estimators (i.e. means computation) of the slices [k0, k1),
+// written to the first channel of the image, which holds the input until then.
+// With the rician correction the bias of the voxels which get an estimate is
+// computed on the way from the regularized bias, held in variances, see main.
+// The other voxels, among which the ones outside the box, keep their input,
+// copied from the mapped input if any.
+static void Aggregate_slices(void* p, int k0, int k1)
+{
+	stageargument* arg = (stageargument*)p;
+	const nlm_real *means = arg->means, *variances = arg->variances;
+	const nlm_real *bias = arg->bias;
+	const nlm_count *label = arg->label;
+	const double *estimate = arg->estimate;
+	const voxelbox& box = arg->box;
+	int ns = arg->channels;
+	double value, b;
+	int i, j, k;
+	ptrdiff_t row;
+	float* dst;
+
+	for (k = k0; k < k1; k++)
+	for (j = 0; j < arg->rows; j++) {
+		dst = Image_row(arg, k, j);
+		if (arg->input != NULL) {
+			ReadNIIMappedRow(arg->input, j, k, arg->cols, ns, dst);
+		}
+		if (k < box.z0 || k >= box.z1 || j < box.y0 || j >= box.y1) {
+			continue;
+		}
+		row = ((ptrdiff_t)k*arg->rows + j)*arg->cols;
+		for (i = box.x0; i < box.x1; i++) {
+			if (label[row+i] == 0) {
+				continue;
+			}
+			value = estimate[row+i]/label[row+i];
+			if (arg->rician) {
+				b = bias[row+i];
+				if (variances[row+i] > 0) {
+					b = 2*(variances[row+i] / Epsi_lookup(arg->epsi, means[row+i] / sqrt(variances[row+i])));
+					b = (nlm_real)b;
+#if defined(WIN32) || defined(WIN64)
+					if (_isnan(b)) {
 #else
-	pthread_exit(0);
+					if (isnan(b)) {
 #endif
+						b = 0;
+					}
+				}
+				value = (value-b) < 0 ? 0 : (value-b);
+				dst[i*ns] = (float)sqrt(value);
+			} else {
+				dst[i*ns] = (float)value;
+			}
+		}
+	}
+}
+
+// Returns the bytes per input voxel held at the peak of main, whose buffers
+// live as follows, R being sizeof(nlm_real):
+//   image (4 per channel, 8 for its voxel pointers): from the start to the
+//   end, or only for the aggregation if the input is mapped
+//   estimates (8) and counts of blocks (sizeof(nlm_count)): from the start to
+//   the end
+//   ima (R): until the end of the NLM, unless it is the mapped input itself,
+//   see Mapped_intensities
+//   means and variances (2 R): until the end of the NLM, or until the end with
+//   the rician correction
+//   bias (R): with the rician correction, after the NLM until the end
+// The arrays of the blocks and of the threads, such as the tile buffers, are
+// left out.
+double Plan_bytes_per_voxel(int channels, bool rician, bool mapped, bool ima_mapped)
+{
+	double R = sizeof(nlm_real);
+	double image = 4*channels + 8;
+	double base = (mapped ? 0 : image) + 8 + sizeof(nlm_count);
+	double I = ima_mapped ? 0 : R;
+	double var = rician ? R : 0;
+	double peak;
+
+	// statistics and NLM
+	peak = base + I + 2*R;
+	// bias
+	peak = MAX(peak, base + 3*var);
+	// aggregation
+	peak = MAX(peak, image + 8 + sizeof(nlm_count) + 3*var);
+	return peak;
+}
+
+// Slices [z0, z1) of a volume of n values of size bytes per slice, held in a
+// buffer of cap slices. Window_origin is the address of the slice 0, outside
+// the buffer unless z0 is 0, so that the stages of main index the window with
+// the coordinates of the volume.
+typedef struct {
+	char* data;
+	size_t size;
+	int n, cap, z0, z1;
+} slicewindow;
+
+static void Window_alloc(slicewindow* w, int n, size_t size, int cap)
+{
+	w->data = (char*)MyAlloc((size_t)cap*n*size);
+	w->size = size;
+	w->n = n;
+	w->cap = cap;
+	w->z0 = w->z1 = 0;
+}
+
+// Moves the window to the slices [z0, z1), z0 not below its first slice,
+// keeping the slices it held among them
+static void Window_move(slicewindow* w, int z0, int z1)
+{
+	size_t slice = (size_t)w->n * w->size;
+
+	if (MIN(z1, w->z1) > z0 && z0 > w->z0) {
+		memmove(w->data, w->data + (z0 - w->z0)*slice, (MIN(z1, w->z1) - z0)*slice);
+	}
+	w->z0 = z0;
+	w->z1 = z1;
+}
 
-	return 0;
+static inline void* Window_origin(const slicewindow* w)
+{
+	return w->data - (ptrdiff_t)w->z0 * w->n * w->size;
+}
+
+// Dimensions and radii of Stream_volume
+typedef struct {
+	int cols, rows, slices, channels;
+	int pad, f, l, r, g, tile, nbx, nby, nbz, ntz;
+	bool rician;
+} streamplan;
+
+// Progress of Stream_volume after a slab, slices [0, read) having been read,
+// [0, stats) having their local statistics, [0, done) being out of reach of
+// the later blocks, their estimates and bias being final, and [0, out)
+// written, with the first slices of the windows of the slab
+typedef struct {
+	int t1, bk0, bk1;
+	int read, stats, done, out;
+	int ima0, means0, vars0, ybuf0, dmin0, est1;
+} slabfront;
+
+// Sets s to the progress after the slab following prev, of up to m tile
+// planes. The slabs end on an odd tile plane, but the last one, so that the
+// tiles of the tile plane of the next slab come in a later parity phase of
+// Filter_tiles, as they do in main.
+static void Slab_next(const streamplan* sp, int m, const slabfront* prev, slabfront* s)
+{
+	int t0 = prev->t1, zc0, zc1, Z = sp->slices, pad = sp->pad;
+
+	// odd for the first slab, even for the others
+	m = (t0 == 0) ? m - 1 + m % 2 : MAX(2, m - m % 2);
+	s->t1 = MIN(sp->ntz, t0 + m);
+	s->bk0 = t0 * sp->tile;
+	s->bk1 = MIN(sp->nbz, s->t1 * sp->tile);
+	// the first and last block centers
+	zc0 = sp->g * s->bk0;
+	zc1 = sp->g * (s->bk1 - 1);
+	if (s->t1 == sp->ntz) {
+		s->read = s->stats = s->done = s->out = Z;
+	} else {
+		s->read = MIN(Z, zc1 + pad + sp->l + 1);
+		s->stats = MIN(Z, zc1 + pad + 1);
+		s->done = sp->g * s->bk1 - sp->f;
+		// the smoothing of the bias reaches r slices farther
+		s->out = sp->rician ? MAX(prev->out, s->done - sp->r) : s->done;
+	}
+	// the tile buffers, the restarts of Statistics_slices, the output and
+	// the smoothing along z of the regularized bias, see Regularize_z
+	s->ima0 = MAX(0, MIN(zc0 - pad, prev->stats - prev->stats % NLM_STATS_RESTART - sp->l));
+	s->means0 = MAX(0, sp->rician ? MIN(zc0 - pad, prev->out) : zc0 - pad);
+	s->vars0 = MAX(0, zc0 - pad);
+	s->ybuf0 = MAX(0, prev->out - sp->r);
+	// the blocks of the bias of the slices [prev->done, done)
+	s->dmin0 = sp->rician ? (MAX(0, prev->done - sp->f) + sp->g-1) / sp->g : s->bk0;
+	s->est1 = MIN(Z, zc1 + sp->f + 1);
+}
+
+// Capacities in slices (block planes for dmin and state) of the windows of
+// Stream_volume
+typedef struct {
+	int raw, ima, means, vars, ybuf, reg, bias, est, dmin, state;
+} streamcaps;
+
+// Returns the bytes of the windows of Stream_volume for slabs of up to m tile
+// planes, and sets caps to their capacities
+static double Stream_bytes(const streamplan* sp, int m, streamcaps* caps)
+{
+	double n = (double)sp->cols*sp->rows, R = sizeof(nlm_real);
+	double nbxy = (double)sp->nbx*sp->nby;
+	slabfront prev, s;
+
+	memset(&prev, 0, sizeof(slabfront));
+	memset(caps, 0, sizeof(streamcaps));
+	// the first pass reads whole cells of the occupancy grid
+	caps->raw = caps->ima = MIN(sp->slices, NLM_CELL);
+	while (prev.t1 < sp->ntz) {
+		Slab_next(sp, m, &prev, &s);
+		caps->raw = MAX(caps->raw, s.read - prev.out);
+		caps->ima = MAX(caps->ima, s.read - s.ima0);
+		caps->means = MAX(caps->means, s.stats - s.means0);
+		caps->vars = MAX(caps->vars, s.stats - s.vars0);
+		caps->est = MAX(caps->est, s.est1 - prev.out);
+		caps->dmin = MAX(caps->dmin, s.bk1 - s.dmin0);
+		caps->state = MAX(caps->state, s.bk1 - s.bk0);
+		if (sp->rician) {
+			caps->ybuf = MAX(caps->ybuf, s.done - s.ybuf0);
+			caps->reg = MAX(caps->reg, s.out - prev.out);
+			caps->bias = MAX(caps->bias, s.done - prev.out);
+		}
+		prev = s;
+	}
+	return n * (caps->raw * 4.0*sp->channels + (caps->ima + caps->means + caps->vars + caps->ybuf + caps->reg + caps->bias) * R +
+		caps->est * (8.0 + sizeof(nlm_count))) + nbxy * (caps->dmin * 8.0 + caps->state);
+}
+
+// Out-of-core filtering of --max-memory, for the volumes which do not fit in
+// memory: the input is streamed twice from its file, a first pass for max_val
+// and the occupancy grid, then a second one which filters it by slabs of whole
+// tile planes, as many as the budget of max_bytes allows, and writes the
+// slices to the output as soon as they are final. A slab holds the slices of
+// its blocks plus halos of v+f+l for the tile buffers and the local
+// statistics, f for the estimates and the bias of its blocks, and r for the
+// smoothing of the bias, which the next slab reads again or carries on. Every
+// voxel goes through the same arithmetic in the same order as in main, so the
+// output is the same: the slabs keep the parity order of the tiles, see
+// Slab_next, the first block which is not filtered is the first one in raster
+// order, and Statistics_slices rounds the same whatever its range. The -a
+// lattice needs the whole volume and is not streamed.
+static void Stream_volume(char* input_image, char* output_image, const NLMKernels* kernels, int Nthreads, int param_w, int param_f, bool rician, int g, int stats_radius, int bias_radius, double max_bytes)
+{
+	NIIStream in, out;
+	int X, Y, Z, S;
+	float dx, dy, dz, ox, oy, oz;
+	analyze_75_orient_code oc;
+	streamplan sp;
+	streamcaps caps;
+	slabfront prev, s;
+	slicewindow raw, ima, means, vars, ybuf, reg, bias, est, lab, dmin, state;
+	unsigned char *grid, *tactive;
+	double *slice_max, max_val, bytes;
+	int n, pad, ncx, ncy, ncz, nt, m, k, z0, z1;
+	ptrdiff_t b, nb, first_skipped;
+	NLMPool *pool;
+	stageargument stage;
+	myargument targ;
+
+	if (!OpenNIIStream(input_image, &in, X, Y, Z, S, dx, dy, dz, ox, oy, oz, oc)) {
+		TRACE("ERROR: couldn't stream the input image: %s", input_image);
+		exit(EXIT_FAILURE);
+	}
+	// the output is created while the input is read a second time
+	if (IsNIIStreamFile(&in, output_image)) {
+		printf("error: with -m, the output image must not be the input image\n");
+		printf("use option -h or --help for help\n");
+		CloseNIIStream(&in);
+		exit(EXIT_FAILURE);
+	}
+	n = X*Y;
+	pad = param_w + param_f;
+
+	sp.cols = X;
+	sp.rows = Y;
+	sp.slices = Z;
+	sp.channels = S;
+	sp.pad = pad;
+	sp.f = param_f;
+	sp.l = stats_radius;
+	sp.r = bias_radius;
+	sp.g = g;
+	sp.tile = MAX((NLM_TILE_VOXELS + g-1) / g, (2*param_f + g-1) / g);
+	sp.nbx = (X + g-1) / g;
+	sp.nby = (Y + g-1) / g;
+	sp.nbz = (Z + g-1) / g;
+	sp.ntz = (sp.nbz + sp.tile-1) / sp.tile;
+	sp.rician = rician;
+	nt = ((sp.nbx + sp.tile-1) / sp.tile) * ((sp.nby + sp.tile-1) / sp.tile) * sp.ntz;
+	nb = (ptrdiff_t)sp.nbx*sp.nby*sp.nbz;
+
+	// the thickest slabs within the budget, two tile planes at least
+	for (m = sp.ntz; m > MIN(2, sp.ntz); m--) {
+		if (Stream_bytes(&sp, m, &caps) <= max_bytes) {
+			break;
+		}
+	}
+	bytes = Stream_bytes(&sp, m, &caps);
+	if (bytes > max_bytes) {
+		printf("error: the slabs need %.0f MB at least, more than the --max-memory of %.0f MB\n", ceil(bytes / (1 << 20)), max_bytes / (1 << 20));
+		printf("use option -h or --help for help\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("memory: %.1f MB at the peak, slabs of %d slices\n", bytes / (1 << 20), MIN(Z, m*g*sp.tile));
+
+	Window_alloc(&raw, n*S, sizeof(float), caps.raw);
+	Window_alloc(&ima, n, sizeof(nlm_real), caps.ima);
+	Window_alloc(&means, n, sizeof(nlm_real), caps.means);
+	Window_alloc(&vars, n, sizeof(nlm_real), caps.vars);
+	Window_alloc(&est, n, sizeof(double), caps.est);
+	Window_alloc(&lab, n, sizeof(nlm_count), caps.est);
+	Window_alloc(&dmin, sp.nbx*sp.nby, sizeof(double), caps.dmin);
+	Window_alloc(&state, sp.nbx*sp.nby, 1, caps.state);
+	Window_alloc(&ybuf, n, sizeof(nlm_real), caps.ybuf);
+	Window_alloc(&reg, n, sizeof(nlm_real), caps.reg);
+	Window_alloc(&bias, n, sizeof(nlm_real), caps.bias);
+	ncx = (X + NLM_CELL-1) / NLM_CELL;
+	ncy = (Y + NLM_CELL-1) / NLM_CELL;
+	ncz = (Z + NLM_CELL-1) / NLM_CELL;
+	grid = (unsigned char*)MyAlloc(ncx*ncy*ncz);
+	tactive = (unsigned char*)MyAlloc(nt);
+	memset(tactive, 0, nt);
+	slice_max = (double*)MyAlloc(Z * sizeof(double));
+
+	pool = Pool_create(Nthreads);
+
+	memset(&stage, 0, sizeof(stageargument));
+	stage.image = NULL;
+	stage.channels = S;
+	stage.cols = X;
+	stage.rows = Y;
+	stage.slices = Z;
+	stage.slice_max = slice_max;
+	stage.stats_radius = stats_radius;
+	stage.rician = rician;
+	stage.epsi = rician ? Epsi_table() : NULL;
+
+	// first pass, by whole cells of the occupancy grid
+	k = MAX(1, MIN(caps.raw, caps.ima) / NLM_CELL) * NLM_CELL;
+	for (z0 = 0; z0 < Z; z0 = z1) {
+		z1 = MIN(Z, z0 + k);
+		Window_move(&raw, z0, z1);
+		Window_move(&ima, z0, z1);
+		if (!ReadNIISlices(&in, z1-z0, (float*)raw.data)) {
+			TRACE("ERROR: couldn't stream the input image: %s", input_image);
+			exit(EXIT_FAILURE);
+		}
+		stage.voxels = (float*)Window_origin(&raw);
+		stage.ima = (nlm_real*)Window_origin(&ima);
+		Pool_for_range(pool, z0, z1, Load_slices, &stage);
+		occupancyargument oarg = { (nlm_real*)Window_origin(&ima), X, Y, Z, ncx, ncy, grid };
+		Pool_for_range(pool, z0 / NLM_CELL, (z1 + NLM_CELL-1) / NLM_CELL, Occupancy_planes, &oarg);
+	}
+	CloseNIIStream(&in);
+	Window_move(&raw, 0, 0);
+	Window_move(&ima, 0, 0);
+	max_val = 0;
+	for (k = 0; k < Z; k++) {
+		if (slice_max[k] > max_val) {
+			max_val = slice_max[k];
+		}
+	}
+	// see main
+	Occupied_box(grid, X, Y, Z, &stage.box);
+	Dilate_box(&stage.box, 4*param_f + stats_radius, X, Y, Z);
+
+	if (!OpenNIIStream(input_image, &in, X, Y, Z, S, dx, dy, dz, ox, oy, oz, oc)) {
+		TRACE("ERROR: couldn't stream the input image: %s", input_image);
+		exit(EXIT_FAILURE);
+	}
+	if (!CreateNIIStream(output_image, input_image, &out, X, Y, Z, S, dx, dy, dz, ox, oy, oz, oc)) {
+		TRACE("ERROR: couldn't write the output image: %s", output_image);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&targ, 0, sizeof(myargument));
+	targ.cols = X;
+	targ.rows = Y;
+	targ.slices = Z;
+	targ.pad = pad;
+	targ.stride = g;
+	targ.nbx = sp.nbx;
+	targ.nby = sp.nby;
+	targ.nbz = sp.nbz;
+	targ.tile = sp.tile;
+	targ.ntx = (sp.nbx + sp.tile-1) / sp.tile;
+	targ.nty = (sp.nby + sp.tile-1) / sp.tile;
+	targ.radioB = param_w;
+	targ.radioS = param_f;
+	targ.rician = rician;
+	targ.max_val = max_val;
+	targ.kernels = kernels;
+	targ.filter = Get_block_filter(param_f, param_w);
+
+	first_skipped = nb;
+	memset(&prev, 0, sizeof(slabfront));
+	while (prev.t1 < sp.ntz) {
+		Slab_next(&sp, m, &prev, &s);
+
+		// the new slices and their local statistics
+		Window_move(&raw, prev.out, s.read);
+		Window_move(&ima, s.ima0, s.read);
+		if (!ReadNIISlices(&in, s.read - prev.read, (float*)Window_origin(&raw) + (size_t)prev.read*n*S)) {
+			TRACE("ERROR: couldn't stream the input image: %s", input_image);
+			exit(EXIT_FAILURE);
+		}
+		stage.voxels = (float*)Window_origin(&raw);
+		stage.ima = (nlm_real*)Window_origin(&ima);
+		stage.estimate = NULL;
+		Pool_for_range(pool, prev.read, s.read, Load_slices, &stage);
+		Window_move(&means, s.means0, s.stats);
+		Window_move(&vars, s.vars0, s.stats);
+		stage.means = (nlm_real*)Window_origin(&means);
+		stage.variances = (nlm_real*)Window_origin(&vars);
+		Pool_for_range(pool, prev.stats, s.stats, Statistics_slices, &stage);
+
+		// the blocks of the slab
+		Window_move(&state, s.bk0, s.bk1);
+		memset(state.data, NLM_BLOCK_ACTIVE, (size_t)(s.bk1 - s.bk0)*state.n);
+		backgroundargument barg = { grid, X, Y, Z, g, sp.nbx, sp.nby, param_f, (unsigned char*)Window_origin(&state) };
+		Pool_for_range(pool, s.bk0, s.bk1, Background_planes, &barg);
+		if (first_skipped == nb) {
+			first_skipped = First_skipped(stage.ima, stage.means, stage.variances, barg.state, g, sp.nbx, sp.nby, sp.nbz, s.bk0, s.bk1, X, Y);
+		}
+		for (b = (ptrdiff_t)s.bk0*state.n; b < (ptrdiff_t)s.bk1*state.n; b++) {
+			if (barg.state[b] == NLM_BLOCK_ACTIVE) {
+				tactive[(((b / (sp.nbx*sp.nby)) / sp.tile)*targ.nty + ((b / sp.nbx) % sp.nby) / sp.tile)*targ.ntx + (b % sp.nbx) / sp.tile] = 1;
+			}
+		}
+		Window_move(&dmin, s.dmin0, s.bk1);
+		for (b = (ptrdiff_t)prev.bk1*dmin.n; b < (ptrdiff_t)s.bk1*dmin.n; b++) {
+			((double*)Window_origin(&dmin))[b] = -1;
+		}
+		Window_move(&est, prev.out, s.est1);
+		Window_move(&lab, prev.out, s.est1);
+		memset((double*)Window_origin(&est) + (size_t)prev.est1*n, 0, (size_t)(s.est1 - prev.est1)*n * sizeof(double));
+		memset((nlm_count*)Window_origin(&lab) + (size_t)prev.est1*n, 0, (size_t)(s.est1 - prev.est1)*n * sizeof(nlm_count));
+
+		targ.in_image = stage.ima;
+		targ.means_image = stage.means;
+		targ.var_image = stage.variances;
+		targ.estimate = (double*)Window_origin(&est);
+		targ.label = (nlm_count*)Window_origin(&lab);
+		targ.bdmin = (double*)Window_origin(&dmin);
+		targ.state = barg.state;
+		targ.first_skipped = first_skipped;
+		Filter_tiles(pool, &targ, tactive, prev.t1, s.t1);
+
+		// the bias of the slices out of reach of the later blocks, smoothed
+		// along x and y from the local variances, then along z up to r
+		// slices before, see Regularize
+		if (rician) {
+			Window_move(&bias, prev.out, s.done);
+			Window_move(&ybuf, s.ybuf0, s.done);
+			Window_move(&reg, prev.out, s.out);
+			biasargument biarg = { targ.bdmin, g, sp.nbx, sp.nby, sp.nbz, param_f, X, Y, (nlm_real*)Window_origin(&bias) };
+			Pool_for_range(pool, prev.done, s.done, Block_bias_slices, &biarg);
+			memcpy((nlm_real*)Window_origin(&ybuf) + (size_t)prev.done*n, stage.variances + (size_t)prev.done*n, (size_t)(s.done - prev.done)*n * sizeof(nlm_real));
+			regargument rarg = { biarg.bias, (nlm_real*)Window_origin(&ybuf), bias_radius, X, Y, Z, stage.box, (nlm_real*)Window_origin(&reg), prev.out, s.out };
+			if (stage.box.x0 < stage.box.x1) {
+				Pool_for_range(pool, prev.done, s.done, Regularize_x, &rarg);
+				Pool_for_range(pool, prev.done, s.done, Regularize_y, &rarg);
+			}
+			memcpy(rarg.dst + (size_t)prev.out*n, rarg.out + (size_t)prev.out*n, (size_t)(s.out - prev.out)*n * sizeof(nlm_real));
+			if (stage.box.x0 < stage.box.x1) {
+				Pool_for(pool, Y, Regularize_z, &rarg);
+			}
+			stage.bias = biarg.bias;
+			stage.variances = rarg.dst;
+		}
+
+		// the final slices, written to the output
+		stage.estimate = targ.estimate;
+		stage.label = targ.label;
+		Pool_for_range(pool, prev.out, s.out, Aggregate_slices, &stage);
+		if (!WriteNIISlices(&out, s.out - prev.out, stage.voxels + (size_t)prev.out*n*S)) {
+			TRACE("ERROR: couldn't write the output image: %s", output_image);
+			exit(EXIT_FAILURE);
+		}
+		prev = s;
+	}
+	Pool_free(pool);
+	CloseNIIStream(&in);
+	CloseNIIStream(&out);
+
+	MyFree(raw.data);
+	MyFree(ima.data);
+	MyFree(means.data);
+	MyFree(vars.data);
+	MyFree(est.data);
+	MyFree(lab.data);
+	MyFree(dmin.data);
+	MyFree(state.data);
+	MyFree(ybuf.data);
+	MyFree(reg.data);
+	MyFree(bias.data);
+	MyFree(grid);
+	MyFree(tactive);
+	MyFree(slice_max);
+	if (stage.epsi != NULL) {
+		MyFree((double*)stage.epsi);
+	}
 }
 
 void version()
@@ -536,10 +2033,16 @@ void usage()
 	printf("Options:\n\n");
 	printf("-i (--input  ) [input_image_file]  : input image file (input)\n");
 	printf("-o (--output ) [output_image_file] : output image file (output)\n");
-	printf("-t (--thread ) [integer]           : number of threads (default=1, option)\n");
+	printf("-t (--thread ) [integer]           : number of threads, 0 for all the CPUs (default=1, option)\n");
 	printf("-v (--search ) [integer]           : radius of the 3D search area (default=3, option)\n");
 	printf("-f (--patch  ) [integer]           : radius of the 3D patch used to compute similarity (default=1, option)\n");
 	printf("-r (--rician ) [1 or 0]            : 1 (default) if apply rician noise estimation, 0 otherwise (option)\n");
+	printf("-s (--simd   ) [auto, none, sse42, avx2 or avx512] : instruction set of the patch distance kernels (default=auto, option)\n");
+	printf("-d (--stride ) [integer]           : voxels between two block centers along each axis, 1 to f+1 (default=2, option)\n");
+	printf("-a (--adaptive) [1 or 0]           : 1 to space the blocks by min(2f, 2*stride) in the flat regions, 0 (default) otherwise (option)\n");
+	printf("-l (--local  ) [integer]           : radius of the windows of the local means and variances (default=1, option)\n");
+	printf("-g (--regularize) [integer]        : radius of the smoothing of the rician bias (default=5, option)\n");
+	printf("-m (--max-memory) [integer]        : filter by slabs streamed from the input within about this many MB, 0 (default) to load the whole volume (option)\n");
 	printf("\n");
 	printf("-h (--help   )                     : print this help\n");
 	printf("-u (--usage  )                     : print this help\n");
@@ -557,6 +2060,12 @@ int main(int argc, char* argv[])
 	int param_f = 1;
 	int Nthreads = 1;
 	bool rician = true;
+	int simd = NLM_SIMD_AUTO;
+	int stride = 2;
+	bool adaptive = false;
+	int stats_radius = 1;
+	int bias_radius = 5;
+	int max_memory = 0;
 
 	// parse command line
 	{
@@ -593,6 +2102,11 @@ int main(int argc, char* argv[])
 			} else if (strcmp(argv[i], "-o" ) == 0 || strcmp(argv[i], "--output") == 0) { sprintf(output_image, "%s", argv[i+1]); i++;
 			} else if (strcmp(argv[i], "-t" ) == 0 || strcmp(argv[i], "--thread") == 0) {
 				Nthreads = atoi(argv[i+1]);
+				if (Nthreads < 0) {
+					printf("error: the number of threads must be 0 (all the CPUs) or more\n");
+					printf("use option -h or --help for help\n");
+					exit(EXIT_FAILURE);
+				}
 				i++;
 			}else if (strcmp(argv[i], "-w" ) == 0 || strcmp(argv[i], "--search") == 0) {
 				param_w = atoi(argv[i+1]);
@@ -606,6 +2120,34 @@ int main(int argc, char* argv[])
 				} else {
 					rician = true;
 				}
+				i++;
+			} else if (strcmp(argv[i], "-s" ) == 0 || strcmp(argv[i], "--simd"  ) == 0) {
+				simd = ParseNLMSimd(argv[i+1]);
+				if (simd == -2) {
+					printf("error: %s is not a supported instruction set\n", argv[i+1]);
+					printf("use option -h or --help for help\n");
+					exit(EXIT_FAILURE);
+				}
+				i++;
+			} else if (strcmp(argv[i], "-d" ) == 0 || strcmp(argv[i], "--stride") == 0) {
+				stride = atoi(argv[i+1]);
+				i++;
+			} else if (strcmp(argv[i], "-a" ) == 0 || strcmp(argv[i], "--adaptive") == 0) {
+				if (atoi(argv[i+1]) == 0) {
+					adaptive = false;
+				} else {
+					adaptive = true;
+				}
+				i++;
+			} else if (strcmp(argv[i], "-l" ) == 0 || strcmp(argv[i], "--local") == 0) {
+				stats_radius = atoi(argv[i+1]);
+				i++;
+			} else if (strcmp(argv[i], "-g" ) == 0 || strcmp(argv[i], "--regularize") == 0) {
+				bias_radius = atoi(argv[i+1]);
+				i++;
+			} else if (strcmp(argv[i], "-m" ) == 0 || strcmp(argv[i], "--max-memory") == 0) {
+				max_memory = atoi(argv[i+1]);
+				i++;
 			} else {
 				printf("error: %s is not recognized\n", argv[i]);
 				printf("use option -h or --help for help\n");
@@ -618,24 +2160,69 @@ int main(int argc, char* argv[])
 			printf("use option -h or --help for help\n");
 			exit(EXIT_FAILURE);
 		}
+		// the patches of blocks spaced by up to f+1 voxels cover the volume
+		if (stride < 1 || stride > MAX(2, param_f+1)) {
+			printf("error: the block stride must be between 1 and f+1 (or 2)\n");
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
+		if (stats_radius < 1) {
+			printf("error: the radius of the local statistics must be at least 1\n");
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
+		if (bias_radius < 0) {
+			printf("error: the radius of the smoothing of the rician bias must be nonnegative\n");
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
+		if (max_memory < 0) {
+			printf("error: the memory budget must be nonnegative\n");
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
+		if (max_memory > 0 && adaptive) {
+			printf("error: the volume is only streamed by slabs without -a\n");
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
+		// the counts of blocks covering a voxel are nlm_count
+		if (param_f > NLM_MAX_PATCH) {
+			printf("error: the patch radius must be at most %d\n", NLM_MAX_PATCH);
+			printf("use option -h or --help for help\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	double *ima, *fima, *average, *bias;
-	double *means, *variances, *Estimate, *Label;
-	double SNR, mean, var, label, estimate;
-	int Ndims, i, j, k, ii, jj, kk, ni, nj, nk, ndim, indice, ini, fin, r;
+	nlm_real *ima, *bias, *means, *variances;
+	nlm_count *Label;
+	unsigned char *occupancy, *state, *tactive;
+	double *average, *Estimate, *slice_max, *epsi, *bdmin;
+	int Ndims, i, k, ndim;
 	int dims0, dims1, dims2, dimsx;
+	int pad, g, tile, nbx, nby, nbz, ntx, nty, ntz, nt;
+	ptrdiff_t first_skipped;
+	bool ima_mapped;
 	double max_val;
+	const NLMKernels* kernels;
 
-	myargument *ThreadArgs;  
-#ifdef _WIN32
-	HANDLE *ThreadList; // Handles to the worker threads
-#else
-	pthread_t *ThreadList;
-#endif
+	NLMPool *pool;
+	stageargument stage;
+	myargument targ;
 
+	kernels = GetNLMKernels(simd, param_f);
+
+	if (max_memory > 0) {
+		Stream_volume(input_image, output_image, kernels, Nthreads, param_w, param_f, rician, stride, stats_radius, bias_radius, max_memory * 1048576.0);
+		exit(EXIT_SUCCESS);
+	}
+
+	// an uncompressed input is read in place from its mapping, the image then
+	// only holding the output from the aggregation on
 	FVolume image;
-	if (!image.load(input_image, 1)) {
+	NIIMapping input;
+	bool mapped = MapNIIData(input_image, &input, image.m_vd_x, image.m_vd_y, image.m_vd_z, image.m_vd_s, image.m_vd_dx, image.m_vd_dy, image.m_vd_dz, image.m_vd_ox, image.m_vd_oy, image.m_vd_oz, image.m_vd_oc) == TRUE;
+	if (!mapped && !image.load(input_image, 1)) {
 		TRACE("ERROR: couldn't load the input image: %s", input_image);
 		exit(EXIT_FAILURE);
 	}
@@ -647,227 +2234,168 @@ int main(int argc, char* argv[])
 	dimsx = dims0 * dims1 *dims2;
 	Ndims = (int)pow((double)(2*param_f+1), ndim);
 
-	// allocate memory
-	ima       = (double*)MyAlloc(dimsx * sizeof(double));
-	fima      = (double*)MyAlloc(dimsx * sizeof(double));
-	means     = (double*)MyAlloc(dimsx * sizeof(double));
-	variances = (double*)MyAlloc(dimsx * sizeof(double));
-	Estimate  = (double*)MyAlloc(dimsx * sizeof(double));
-	Label     = (double*)MyAlloc(dimsx * sizeof(double));
-	if (rician) {
-		bias  = (double*)MyAlloc(dimsx * sizeof(double));
-	}
-	average   = (double*)MyAlloc(Ndims * sizeof(double));
+	pad = param_w + param_f;
+	ima = Mapped_intensities(mapped ? &input : NULL, dims0, dims1, image.m_vd_s);
+	ima_mapped = (ima != NULL);
+	printf("memory: %.1f bytes per voxel at the peak\n", Plan_bytes_per_voxel(image.m_vd_s, rician, mapped, ima_mapped));
 
-	for (i = 0; i < dimsx;i++) {
-		Estimate[i] = 0.0;
-		Label[i] = 0.0;
-		fima[i] = 0.0;
-		if (rician) {
-			bias[i] = 0.0;
-		}
+	// allocate memory, see Plan_bytes_per_voxel for the lifetimes
+	if (!ima_mapped) {
+		ima = (nlm_real*)MyAlloc(dimsx * sizeof(nlm_real));
 	}
-
+	means     = (nlm_real*)MyAlloc(dimsx * sizeof(nlm_real));
+	variances = (nlm_real*)MyAlloc(dimsx * sizeof(nlm_real));
+	Estimate  = (double*)MyAlloc(dimsx * sizeof(double));
+	Label     = (nlm_count*)MyAlloc(dimsx * sizeof(nlm_count));
+	bias      = NULL;
+	average   = (double*)MyAlloc(Ndims * sizeof(double));
+	slice_max = (double*)MyAlloc(dims2 * sizeof(double));
+
+	// the threads of every stage, created once
+	pool = Pool_create(Nthreads);
+	Nthreads = Pool_size(pool);
+
+	stage.image = &image;
+	stage.voxels = NULL;
+	stage.input = mapped ? &input : NULL;
+	stage.channels = image.m_vd_s;
+	stage.cols = dims0;
+	stage.rows = dims1;
+	stage.slices = dims2;
+	stage.ima = ima;
+	stage.means = means;
+	stage.variances = variances;
+	stage.bias = NULL;
+	stage.label = Label;
+	stage.estimate = Estimate;
+	stage.slice_max = slice_max;
+	stage.rician = rician;
+	stage.epsi = epsi = NULL;
+	stage.stats_radius = stats_radius;
+
+	Pool_for(pool, dims2, Load_slices, &stage);
 	max_val = 0;
 	for (k = 0; k < dims2; k++) {
-		for (j = 0; j < dims1; j++) {
-			for (i = 0; i < dims0; i++) {
-				double val = (double)image.m_pData[k][j][i][0];
-				if (val > max_val) {
-					max_val = val;
-				}
-				ima[k*(dims0*dims1)+(j*dims0)+i] = val;
-				//
-				mean = 0;
-				indice = 0;
-				for (ii = -1; ii <= 1; ii++) {
-					for (jj = -1; jj <= 1; jj++) {
-						for (kk =-1; kk <= 1; kk++) {
-							ni = i+ii;
-							nj = j+jj;		   		  
-							nk = k+kk;
-							if (ni < 0) ni = -ni;
-							if (nj < 0) nj = -nj;
-							if (nk < 0) nk = -nk;
-							if (ni >= dims0) ni = 2*dims0-ni-1;
-							if (nj >= dims1) nj = 2*dims1-nj-1;
-							if (nk >= dims2) nk = 2*dims2-nk-1;
-							mean += image.m_pData[nk][nj][ni][0];
-							indice++;
-						}
-					}
-				}
-				mean = mean / indice;
-				means[k*(dims0*dims1)+(j*dims0)+i] = mean;
-			}
+		if (slice_max[k] > max_val) {
+			max_val = slice_max[k];
 		}
 	}
-	
-	for (k = 0; k < dims2; k++) {
-		for (j = 0; j < dims1; j++) {
-			for (i = 0; i < dims0; i++) {
-				var = 0;
-				indice = 0;
-				for (ii = -1; ii <= 1; ii++) {
-					for (jj = -1; jj <= 1; jj++) {
-						for (kk = -1; kk <= 1; kk++) {
-							ni = i+ii;
-							nj = j+jj;
-							nk = k+kk;
-							//if (ni >= 0 && nj >= 0 && nk > 0 && ni < dims0 && nj < dims1 && nk < dims2) {
-							if (ni >= 0 && nj >= 0 && nk >= 0 && ni < dims0 && nj < dims1 && nk < dims2) {
-								var = var + (ima[nk*(dims0*dims1)+(nj*dims0)+ni] - means[k*(dims0*dims1)+(j*dims0)+i]) * 
-									        (ima[nk*(dims0*dims1)+(nj*dims0)+ni] - means[k*(dims0*dims1)+(j*dims0)+i]);
-								indice = indice+1;
-							}
-						}
-					}
-				}
-				var = var / (indice-1);
-				variances[k*(dims0*dims1)+(j*dims0)+i] = var;
-			}
+	Pool_for(pool, dims2, Statistics_slices, &stage);
+
+	// active region: the blocks far from any nonzero voxel are not filtered,
+	// see Background_blocks, and the voxels farther than 4f+l-1 from the
+	// bounding box of the nonzero ones, which no filtered block covers and whose
+	// means and variances are 0, are copied through by the later stages
+	occupancy = Occupancy_grid(pool, ima, dims0, dims1, dims2, &stage.box);
+	Dilate_box(&stage.box, 4*param_f + stats_radius, dims0, dims1, dims2);
+
+	// blocks centered every stride voxels, or, with -a, every flat stride
+	// voxels in the flat regions, on a lattice of stride g grouped in tiles
+	g = Block_lattice(pool, ima, variances, dims0, dims1, dims2, stride, adaptive ? MIN(2*param_f, 2*stride) : stride, param_f, &nbx, &nby, &nbz, &state);
+	tile = MAX((NLM_TILE_VOXELS + g-1) / g, (2*param_f + g-1) / g);
+	ntx = (nbx + tile-1) / tile;
+	nty = (nby + tile-1) / tile;
+	ntz = (nbz + tile-1) / tile;
+	nt = ntx*nty*ntz;
+	Background_blocks(pool, occupancy, dims0, dims1, dims2, g, nbx, nby, nbz, param_f, state);
+	MyFree(occupancy);
+
+	first_skipped = First_skipped(ima, means, variances, state, g, nbx, nby, nbz, 0, nbz, dims0, dims1);
+	// the tiles with an active block
+	tactive = (unsigned char*)MyAlloc(nt);
+	memset(tactive, 0, nt);
+	for (k = 0; k < nbx*nby*nbz; k++) {
+		if (state[k] == NLM_BLOCK_ACTIVE) {
+			tactive[(((k / (nbx*nby)) / tile)*nty + ((k / nbx) % nby) / tile)*ntx + (k % nbx) / tile] = 1;
 		}
 	}
 
-
-#if defined(WIN32) || defined(WIN64)
-	// Reserve room for handles of threads in ThreadList
-	ThreadList = (HANDLE*)malloc(Nthreads * sizeof(HANDLE));
-	ThreadArgs = (myargument*)malloc(Nthreads * sizeof(myargument));
-
-	for (i = 0; i < Nthreads; i++)
-	{
-		// Make Thread Structure
-		ini = (i*dims2) / Nthreads;
-		fin = ((i+1)*dims2) / Nthreads;
-		ThreadArgs[i].cols = dims0;
-		ThreadArgs[i].rows = dims1;
-		ThreadArgs[i].slices = dims2;
-		ThreadArgs[i].in_image = ima;
-		ThreadArgs[i].var_image = variances;
-		ThreadArgs[i].means_image = means;
-		ThreadArgs[i].estimate = Estimate;
-		ThreadArgs[i].bias = bias;
-		ThreadArgs[i].label = Label;
-		ThreadArgs[i].ini = ini;
-		ThreadArgs[i].fin = fin;
-		ThreadArgs[i].radioB = param_w;
-		ThreadArgs[i].radioS = param_f;
-		ThreadArgs[i].rician = rician;
-		ThreadArgs[i].max_val = max_val;
-
-		ThreadList[i] = (HANDLE)_beginthreadex(NULL, 0, &ThreadFunc, &ThreadArgs[i], 0, NULL);
-	}
-
-	for (i = 0; i < Nthreads; i++) {
-		WaitForSingleObject(ThreadList[i], INFINITE);
-	}
-	for (i = 0; i < Nthreads; i++) {
-		CloseHandle(ThreadList[i]);
-	}
-#else
-	// Reserve room for handles of threads in ThreadList
-	ThreadList = (pthread_t *)calloc(Nthreads, sizeof(pthread_t));
-	ThreadArgs = (myargument*)calloc(Nthreads, sizeof(myargument));
-
-	for (i = 0; i < Nthreads; i++) {
-		// Make Thread Structure
-		ini = (i*dims2) / Nthreads;
-		fin = ((i+1)*dims2) / Nthreads;
-		ThreadArgs[i].cols = dims0;
-		ThreadArgs[i].rows = dims1;
-		ThreadArgs[i].slices = dims2;
-		ThreadArgs[i].in_image = ima;
-		ThreadArgs[i].var_image = variances;
-		ThreadArgs[i].means_image = means;
-		ThreadArgs[i].estimate = Estimate;
-		ThreadArgs[i].bias = bias;
-		ThreadArgs[i].label = Label;
-		ThreadArgs[i].ini = ini;
-		ThreadArgs[i].fin = fin;
-		ThreadArgs[i].radioB = param_w;
-		ThreadArgs[i].radioS = param_f;
-		ThreadArgs[i].rician = rician;
-		ThreadArgs[i].max_val = max_val;
-	}
-
-	for (i = 0; i < Nthreads; i++) {
-		if (pthread_create(&ThreadList[i], NULL, ThreadFunc, &ThreadArgs[i])) {
-			TRACE("Threads cannot be created\n");
-			exit(EXIT_FAILURE);
-		}
+	bdmin = (double*)MyAlloc(nbx*nby*nbz * sizeof(double));
+	for (i = 0; i < nbx*nby*nbz; i++) {
+		bdmin[i] = -1;
 	}
 
-	for (i=0; i<Nthreads; i++) {
-		pthread_join(ThreadList[i], NULL);
+	// Make Thread Structure
+	memset(&targ, 0, sizeof(myargument));
+	targ.cols = dims0;
+	targ.rows = dims1;
+	targ.slices = dims2;
+	targ.in_image = ima;
+	targ.means_image = means;
+	targ.var_image = variances;
+	targ.pad = pad;
+	targ.estimate = Estimate;
+	targ.label = Label;
+	targ.stride = g;
+	targ.nbx = nbx;
+	targ.nby = nby;
+	targ.nbz = nbz;
+	targ.tile = tile;
+	targ.ntx = ntx;
+	targ.nty = nty;
+	targ.bdmin = bdmin;
+	targ.first_skipped = first_skipped;
+	targ.state = state;
+	targ.radioB = param_w;
+	targ.radioS = param_f;
+	targ.rician = rician;
+	targ.max_val = max_val;
+	targ.kernels = kernels;
+	targ.filter = Get_block_filter(param_f, param_w);
+	Filter_tiles(pool, &targ, tactive, 0, ntz);
+
+	// the means and variances are kept for the rician correction, the variances
+	// as the initial values of the regularized bias, see Regularize
+	if (!ima_mapped) {
+		MyFree(ima);
 	}
-#endif
-
-	free(ThreadArgs); 
-	free(ThreadList);
+	ima = stage.ima = NULL;
+	if (!rician) {
+		MyFree(means);
+		MyFree(variances);
+		means = stage.means = NULL;
+		variances = stage.variances = NULL;
+	}
+	MyFree(state);
+	MyFree(tactive);
 
 	if (rician) {
-		r = 5;
-		Regularize(bias, variances, r, dims0, dims1, dims2);
-		for (i = 0; i < dimsx; i++) {
-			if (variances[i] > 0) {
-				SNR = means[i] / sqrt(variances[i]);
-				bias[i] = 2*(variances[i] / Epsi(SNR));
-#if defined(WIN32) || defined(WIN64)                
-				if (_isnan(bias[i])) {
-#else
-				if (isnan(bias[i])) {
-#endif
-					bias[i] = 0;
-				}
-			}
-		}
+		biasargument barg = { bdmin, g, nbx, nby, nbz, param_f, dims0, dims1, NULL };
+		barg.bias = bias = (nlm_real*)MyAlloc(dimsx * sizeof(nlm_real));
+		Pool_for(pool, dims2, Block_bias_slices, &barg);
+		stage.bias = bias;
+		Regularize(pool, bias, variances, bias_radius, dims0, dims1, dims2, &stage.box);
+		stage.epsi = epsi = Epsi_table();
 	}
+	MyFree(bdmin);
 
-	// Aggregation of the estimators (i.e. means computation)
-	label = 0.0;
-	estimate = 0.0;
-	for (i = 0; i < dimsx; i++) {
-		label = Label[i];
-		if (label == 0.0) {
-			fima[i] = ima[i];
-		} else {
-			estimate = Estimate[i];
-			estimate = (estimate/label);
-			if (rician) {
-				estimate = (estimate-bias[i]) < 0 ? 0 : (estimate-bias[i]);
-				fima[i] = sqrt(estimate);
-			} else {
-				fima[i] = estimate;
-			}
-		}       
+	// the filtered volume goes straight into the image
+	if (mapped) {
+		image.allocate(dims0, dims1, dims2, image.m_vd_s, image.m_vd_dx, image.m_vd_dy, image.m_vd_dz);
 	}
-
-	// save output image
-	for (k = 0; k < dims2; k++) {
-		for (j = 0; j < dims1; j++) {
-			for (i = 0; i < dims0; i++) {
-				image.m_pData[k][j][i][0] = (float)fima[k*(dims0*dims1)+(j*dims0)+i];
-			}
-		}
-	}
-	image.save(output_image, 1);
-	if (!ChangeNIIHeader(output_image, input_image)) {
-		TRACE("ChangeNIIHeader failed\n");
+	Pool_for(pool, dims2, Aggregate_slices, &stage);
+	Pool_free(pool);
+	if (mapped) {
+		UnmapNIIData(&input);
 	}
-	//
 
-	// free memory
-	MyFree(ima);
-	MyFree(fima);
-	MyFree(means);
-	MyFree(variances);
+	// free memory before the output image is written
 	MyFree(Estimate);
 	MyFree(Label);
 	if (rician) {
+		MyFree(means);
+		MyFree(variances);
 		MyFree(bias);
+		MyFree(epsi);
 	}
 	MyFree(average);
+	MyFree(slice_max);
+
+	// save output image
+	image.save(output_image, 1);
+	if (!ChangeNIIHeader(output_image, input_image)) {
+		TRACE("ChangeNIIHeader failed\n");
+	}
 	
 	exit(EXIT_SUCCESS);
 }
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 ////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -42,6 +43,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <time.h>
 //
@@ -52,6 +54,7 @@
 #include <sys/wait.h>
 #include <float.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #if !defined(__APPLE__)
 #include <sys/sendfile.h>
 #endif